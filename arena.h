@@ -0,0 +1,120 @@
+#ifndef AAALGO_ARENA
+#define AAALGO_ARENA
+
+#include <stddef.h>
+#include <memory>
+#include <type_traits>
+#include <vector>
+#include <algorithm>
+
+// Bump allocator.  Memory comes from blocks that are only ever released
+// all at once, by clear() or the destructor; pointers stay valid until
+// then, also across moves of the arena.
+class Arena {
+    std::vector<std::unique_ptr<char[]>> blocks;
+    char *cur;
+    size_t left;
+    size_t block;
+    size_t total;       // bytes in blocks
+public:
+    static size_t const DEFAULT_BLOCK = 64 * 1024;
+
+    Arena (size_t block_ = DEFAULT_BLOCK): cur(nullptr), left(0), block(block_), total(0) {
+    }
+
+    // the source is left empty, not pointing into blocks it gave away
+    Arena (Arena &&o): blocks(std::move(o.blocks)), cur(o.cur), left(o.left), block(o.block), total(o.total) {
+        o.blocks.clear();
+        o.cur = nullptr;
+        o.left = 0;
+        o.total = 0;
+    }
+
+    Arena &operator = (Arena &&o) {
+        if (this != &o) {
+            blocks = std::move(o.blocks);
+            cur = o.cur;
+            left = o.left;
+            block = o.block;
+            total = o.total;
+            o.blocks.clear();
+            o.cur = nullptr;
+            o.left = 0;
+            o.total = 0;
+        }
+        return *this;
+    }
+
+    // n bytes aligned to align (a power of 2); never null, even for n == 0
+    char *alloc (size_t n, size_t align = 1) {
+        size_t pad = (align - reinterpret_cast<uintptr_t>(cur) % align) % align;
+        if (!cur || pad + n > left) {
+            size_t sz = std::max(block, n + align);
+            blocks.emplace_back(new char[sz]);
+            cur = blocks.back().get();
+            left = sz;
+            total += sz;
+            pad = (align - reinterpret_cast<uintptr_t>(cur) % align) % align;
+        }
+        char *p = cur + pad;
+        cur += pad + n;
+        left -= pad + n;
+        return p;
+    }
+
+    // copy of [p, p + n)
+    char const *copy (char const *p, size_t n) {
+        char *d = alloc(n);
+        std::copy(p, p + n, d);
+        return d;
+    }
+
+    size_t bytes () const {
+        return total;
+    }
+
+    void clear () {
+        blocks.clear();
+        cur = nullptr;
+        left = 0;
+        total = 0;
+    }
+};
+
+// STL allocator handing out memory of an Arena.  deallocate() is a no-op;
+// everything goes when the arena is cleared or destroyed, which must not
+// happen before the containers using it are gone.
+template <typename T>
+struct ArenaAllocator {
+    typedef T value_type;
+    // containers swapped or moved take their arena along
+    typedef std::true_type propagate_on_container_swap;
+    typedef std::true_type propagate_on_container_move_assignment;
+    Arena *arena;
+
+    ArenaAllocator (Arena *a): arena(a) {
+    }
+
+    template <typename U>
+    ArenaAllocator (ArenaAllocator<U> const &o): arena(o.arena) {
+    }
+
+    T *allocate (size_t n) {
+        return reinterpret_cast<T *>(arena->alloc(n * sizeof(T), alignof(T)));
+    }
+
+    void deallocate (T *, size_t) {
+    }
+};
+
+template <typename T, typename U>
+bool operator == (ArenaAllocator<T> const &a, ArenaAllocator<U> const &b) {
+    return a.arena == b.arena;
+}
+
+template <typename T, typename U>
+bool operator != (ArenaAllocator<T> const &a, ArenaAllocator<U> const &b) {
+    return a.arena != b.arena;
+}
+
+#endif
@@ -0,0 +1,515 @@
+#ifndef AAALGO_ARROW
+#define AAALGO_ARROW
+
+#include <stdint.h>
+#include <functional>
+#include "csvlint.h"
+#include "bigtext.h"
+
+// Arrow IPC output (stream and file formats) without the Arrow library.
+// Only what csvlint needs is implemented: a flat schema of bool, int32,
+// int64, float64, date32, timestamp and utf8 columns, one record batch per
+// BigText chunk, no dictionaries.
+namespace csvlint { namespace ipc {
+
+    // Flatbuffer written front to back: every table is preceded by its
+    // vtable and followed by the objects it references, so all offsets
+    // point forward as the format requires.
+    class FlatBuffer {
+        string buf;
+    public:
+        size_t size () const {
+            return buf.size();
+        }
+
+        void pad (size_t align) {
+            while (buf.size() % align) buf.push_back(0);
+        }
+
+        template <typename T>
+        size_t put (T v) {
+            size_t p = buf.size();
+            buf.append(reinterpret_cast<char const *>(&v), sizeof(v));
+            return p;
+        }
+
+        void append (char const *p, size_t n) {
+            buf.append(p, n);
+        }
+
+        void set (size_t at, void const *v, size_t n) {
+            memcpy(&buf[at], v, n);
+        }
+
+        // make the uoffset at position at refer to target
+        void link (size_t at, size_t target) {
+            BOOST_VERIFY(target > at);
+            uint32_t v = target - at;
+            set(at, &v, sizeof(v));
+        }
+
+        string &bytes () {
+            return buf;
+        }
+    };
+
+    // writes an object, returns the position offsets should refer to
+    typedef std::function<size_t(FlatBuffer &)> Object;
+
+    class Table {
+        struct Slot {
+            unsigned id;
+            unsigned size;      // 0 for an offset to a child object
+            uint64_t value;
+            Object child;
+        };
+        vector<Slot> slots;
+    public:
+        template <typename T>
+        Table &scalar (unsigned id, T v) {
+            Slot s{id, sizeof(T), 0, nullptr};
+            memcpy(&s.value, &v, sizeof(T));
+            slots.push_back(s);
+            return *this;
+        }
+
+        Table &child (unsigned id, Object obj) {
+            slots.push_back(Slot{id, 0, 0, obj});
+            return *this;
+        }
+
+        size_t operator () (FlatBuffer &fb) const {
+            unsigned nf = 0;
+            size_t align = 4;
+            for (auto const &s: slots) {
+                nf = std::max(nf, s.id + 1);
+                align = std::max<size_t>(align, s.size);
+            }
+            // inline layout after the vtable soffset, largest fields first
+            vector<Slot const *> order;
+            for (auto const &s: slots) order.push_back(&s);
+            std::stable_sort(order.begin(), order.end(), [](Slot const *a, Slot const *b) {
+                return (a->size ? a->size : 4) > (b->size ? b->size : 4);
+            });
+            vector<uint16_t> voff(nf, 0);
+            unsigned off = 4;
+            for (auto s: order) {
+                unsigned sz = s->size ? s->size : 4;
+                off = (off + sz - 1) / sz * sz;
+                voff[s->id] = off;
+                off += sz;
+            }
+            fb.pad(2);
+            size_t vt = fb.put<uint16_t>(4 + 2 * nf);
+            fb.put<uint16_t>(off);
+            for (auto v: voff) fb.put<uint16_t>(v);
+            fb.pad(align);
+            size_t tp = fb.size();
+            fb.put<int32_t>(tp - vt);
+            string zeros(off - 4, 0);
+            fb.append(zeros.data(), zeros.size());
+            for (auto const &s: slots) {
+                if (s.size) fb.set(tp + voff[s.id], &s.value, s.size);
+            }
+            for (auto const &s: slots) {
+                if (!s.size) fb.link(tp + voff[s.id], s.child(fb));
+            }
+            return tp;
+        }
+    };
+
+    inline Object str (string const &s) {
+        return [s](FlatBuffer &fb) {
+            fb.pad(4);
+            size_t p = fb.put<uint32_t>(s.size());
+            fb.append(s.data(), s.size());
+            fb.put<char>(0);
+            return p;
+        };
+    }
+
+    inline Object tables (vector<Object> const &v) {
+        return [v](FlatBuffer &fb) {
+            fb.pad(4);
+            size_t p = fb.put<uint32_t>(v.size());
+            for (unsigned i = 0; i < v.size(); ++i) fb.put<uint32_t>(0);
+            for (unsigned i = 0; i < v.size(); ++i) {
+                fb.link(p + 4 + 4 * i, v[i](fb));
+            }
+            return p;
+        };
+    }
+
+    // vector of structs made of int64 members, n members per struct
+    inline Object int64s (vector<int64_t> const &v, unsigned n) {
+        return [v, n](FlatBuffer &fb) {
+            while ((fb.size() + 4) % 8) fb.put<char>(0);
+            size_t p = fb.put<uint32_t>(v.size() / n);
+            fb.append(reinterpret_cast<char const *>(v.data()), v.size() * sizeof(int64_t));
+            return p;
+        };
+    }
+
+    // flatbuffer with its root table
+    inline string finish (Table const &root) {
+        FlatBuffer fb;
+        fb.put<uint32_t>(0);
+        fb.link(0, root(fb));
+        fb.pad(8);
+        return fb.bytes();
+    }
+
+    enum {
+        METADATA_V5 = 4,
+        HEADER_SCHEMA = 1,
+        HEADER_RECORD_BATCH = 3,
+        TYPE_INT = 2,
+        TYPE_FLOATING_POINT = 3,
+        TYPE_UTF8 = 5,
+        TYPE_BOOL = 6,
+        TYPE_DATE = 8,
+        TYPE_TIMESTAMP = 10,
+        PRECISION_DOUBLE = 2,
+        DATE_UNIT_DAY = 0,
+        TIME_UNIT_SECOND = 0
+    };
+
+    struct Column {
+        string name;
+        int type;               // Arrow type
+        unsigned width;         // bytes per value, 0 for bool and utf8
+        Kernel parse;           // null for utf8
+
+        Column (Field const &f)
+            : name(f.name.size() ? f.name : "c" + std::to_string(f.column)), parse(kernel(f.kind)) {
+            switch (f.kind) {
+                case KIND_BOOL: type = TYPE_BOOL; width = 0; break;
+                case KIND_INT32: type = TYPE_INT; width = 4; break;
+                case KIND_INT64: type = TYPE_INT; width = 8; break;
+                case KIND_FLOAT64: type = TYPE_FLOATING_POINT; width = 8; break;
+                case KIND_DATE: type = TYPE_DATE; width = 4; break;
+                case KIND_TIMESTAMP: type = TYPE_TIMESTAMP; width = 8; break;
+                default: type = TYPE_UTF8; width = 0; parse = nullptr;
+            }
+        }
+    };
+
+    inline Table schema (vector<Column> const &columns) {
+        vector<Object> fields;
+        for (auto const &c: columns) {
+            Table type;
+            if (c.type == TYPE_INT) {
+                type.scalar<int32_t>(0, c.width * 8)
+                    .scalar<uint8_t>(1, 1);         // signed
+            }
+            else if (c.type == TYPE_FLOATING_POINT) {
+                type.scalar<int16_t>(0, PRECISION_DOUBLE);
+            }
+            else if (c.type == TYPE_DATE) {
+                type.scalar<int16_t>(0, DATE_UNIT_DAY);
+            }
+            else if (c.type == TYPE_TIMESTAMP) {
+                type.scalar<int16_t>(0, TIME_UNIT_SECOND);
+            }
+            Table f;
+            f.child(0, str(c.name))
+             .scalar<uint8_t>(1, 1)         // nullable
+             .scalar<uint8_t>(2, c.type)
+             .child(3, type)
+             .child(5, tables(vector<Object>()));
+            fields.push_back(f);
+        }
+        Table s;
+        s.scalar<int16_t>(0, 0)             // little endian
+         .child(1, tables(fields));
+        return s;
+    }
+
+    inline Table message (uint8_t header_type, Object header, int64_t body) {
+        Table m;
+        m.scalar<int16_t>(0, METADATA_V5)
+         .scalar<uint8_t>(1, header_type)
+         .child(2, header)
+         .scalar<int64_t>(3, body);
+        return m;
+    }
+
+    // Encapsulated message: continuation marker, metadata length, the
+    // flatbuffer padded to 8 bytes, then the body.
+    inline void encapsulate (string const &meta, string const &body, string *out, size_t *meta_len) {
+        uint32_t head[2] = {0xFFFFFFFFu, uint32_t(meta.size())};
+        out->append(reinterpret_cast<char const *>(head), sizeof(head));
+        out->append(meta);
+        *meta_len = sizeof(head) + meta.size();
+        out->append(body);
+    }
+
+    // One record batch built from the parsed lines of a chunk.
+    class Batch {
+        vector<Column> const &columns;
+        size_t rows;
+        vector<string> validity;
+        vector<size_t> nulls;
+        vector<string> values;      // fixed-width values, bool bits, or utf8 bytes
+        vector<vector<int32_t>> offsets;
+        size_t failed;              // values that did not parse, written as null
+    public:
+        Batch (vector<Column> const &c)
+            : columns(c), rows(0), validity(c.size()), nulls(c.size(), 0), values(c.size()), offsets(c.size()), failed(0) {
+            for (unsigned i = 0; i < c.size(); ++i) {
+                if (c[i].type == TYPE_UTF8) offsets[i].push_back(0);
+            }
+        }
+
+        void add (vector<crange> const &cols, vector<Field> const &fields) {
+            if (rows % 8 == 0) {
+                for (auto &v: validity) v.push_back(0);
+            }
+            for (unsigned i = 0; i < columns.size(); ++i) {
+                crange const &e = cols[fields[i].column];
+                bool valid = !e.missing();
+                Column const &c = columns[i];
+                if (c.parse) {
+                    Value v;
+                    v.i = 0;
+                    if (valid) {
+                        valid = c.parse(e, fields[i], &v);
+                        if (!valid) {
+                            v.i = 0;
+                            ++failed;
+                        }
+                    }
+                    if (c.type == TYPE_BOOL) {
+                        if (rows % 8 == 0) values[i].push_back(0);
+                        if (v.i) values[i].back() |= char(1 << (rows % 8));
+                    }
+                    else if (c.width == 4) {
+                        int32_t x = v.i;
+                        values[i].append(reinterpret_cast<char const *>(&x), sizeof(x));
+                    }
+                    else {
+                        values[i].append(reinterpret_cast<char const *>(&v), sizeof(v));
+                    }
+                }
+                else {
+                    if (valid) values[i].append(e.begin(), e.size());
+                    offsets[i].push_back(values[i].size());
+                }
+                if (valid) {
+                    validity[i].back() |= char(1 << (rows % 8));
+                }
+                else {
+                    ++nulls[i];
+                }
+            }
+            ++rows;
+        }
+
+        size_t failures () const {
+            return failed;
+        }
+
+        // encapsulated RecordBatch message
+        void serialize (string *out, size_t *meta_len, size_t *body_len) const {
+            string body;
+            vector<int64_t> nodes, buffers;
+            auto buffer = [&](char const *p, size_t n) {
+                buffers.push_back(body.size());
+                buffers.push_back(n);
+                body.append(p, n);
+                body.resize((body.size() + 7) / 8 * 8, 0);
+            };
+            for (unsigned i = 0; i < columns.size(); ++i) {
+                nodes.push_back(rows);
+                nodes.push_back(nulls[i]);
+                if (nulls[i]) {
+                    buffer(validity[i].data(), validity[i].size());
+                }
+                else {
+                    buffer("", 0);
+                }
+                if (columns[i].type == TYPE_UTF8) {
+                    buffer(reinterpret_cast<char const *>(&offsets[i][0]), offsets[i].size() * sizeof(int32_t));
+                }
+                buffer(values[i].data(), values[i].size());
+            }
+            Table rb;
+            rb.scalar<int64_t>(0, rows)
+              .child(1, int64s(nodes, 2))       // FieldNode { length, null_count }
+              .child(2, int64s(buffers, 2));    // Buffer { offset, length }
+            string meta = finish(message(HEADER_RECORD_BATCH, rb, body.size()));
+            encapsulate(meta, body, out, meta_len);
+            *body_len = body.size();
+        }
+
+    };
+
+    // Writes the stream format, or the file format (stream wrapped in
+    // magic and followed by a footer indexing the record batches).
+    class Output {
+        int fd;
+        bool file;
+        vector<Column> columns;
+        size_t written;
+        vector<int64_t> blocks;     // offset, metadata length, body length
+
+        void out (string const &s) {
+            write_fully(fd, s.data(), s.size());
+            written += s.size();
+        }
+    public:
+        Output (int fd_, bool file_, vector<Column> const &c): fd(fd_), file(file_), columns(c), written(0) {
+            if (file) {
+                out(string("ARROW1\0\0", 8));
+            }
+            string msg;
+            size_t meta_len;
+            encapsulate(finish(message(HEADER_SCHEMA, schema(columns), 0)), string(), &msg, &meta_len);
+            out(msg);
+        }
+
+        void batch (string const &msg, size_t meta_len, size_t body_len) {
+            blocks.push_back(written);
+            blocks.push_back(meta_len);     // int32 padded to 8 bytes in the Block struct
+            blocks.push_back(body_len);
+            out(msg);
+        }
+
+        void close () {
+            uint32_t eos[2] = {0xFFFFFFFFu, 0};
+            out(string(reinterpret_cast<char const *>(eos), sizeof(eos)));
+            if (!file) return;
+            Table footer;
+            footer.scalar<int16_t>(0, METADATA_V5)
+                  .child(1, schema(columns))
+                  .child(2, int64s(vector<int64_t>(), 3))
+                  .child(3, [this](FlatBuffer &fb) {
+                        // Block { offset: long; metaDataLength: int; bodyLength: long; }
+                        while ((fb.size() + 4) % 8) fb.put<char>(0);
+                        size_t p = fb.put<uint32_t>(blocks.size() / 3);
+                        for (size_t i = 0; i < blocks.size(); i += 3) {
+                            fb.put<int64_t>(blocks[i]);
+                            fb.put<int32_t>(blocks[i+1]);
+                            fb.put<int32_t>(0);
+                            fb.put<int64_t>(blocks[i+2]);
+                        }
+                        return p;
+                    });
+            string f = finish(footer);
+            int32_t len = f.size();
+            out(f);
+            out(string(reinterpret_cast<char const *>(&len), sizeof(len)));
+            out("ARROW1");
+        }
+    };
+
+    struct Chunk {
+        string msg;
+        size_t meta_len;
+        size_t body_len;
+        size_t bad;
+        size_t failed;
+    };
+
+    // kind b if it was widened at least as far as a from the same kind
+    inline int wider (int a, int b) {
+        for (int k = a; k != KIND_STRING; k = widen(k)) {
+            if (k == b) return b;
+        }
+        return b == KIND_STRING ? b : a;
+    }
+
+    struct KindChunk {
+        vector<Field> fields;
+        vector<crange> cols;
+    };
+
+    // Kinds are trained on a sample.  Widens each field's kind until its
+    // kernel accepts every value in input, so no value outside the
+    // sample turns into a null.  Reads the data once more.
+    inline void widen_kinds (string const &input, Format const &fmt, vector<Field> *fields) {
+        BigText<KindChunk> text(input, fmt.data_offset, '\n', fmt.max_line, 10 * 1024 * 1024, true);
+        text.lines([&fmt](char const *b, char const *e, KindChunk *ch, size_t) {
+            if (ch->fields.empty()) ch->fields = fmt.fields;
+            if (!fmt.parse(crange(b, e), &ch->cols)) return;
+            for (auto &f: ch->fields) {
+                crange const &c = ch->cols[f.column];
+                if (c.missing()) continue;
+                Value v;
+                for (Kernel k = kernel(f.kind); k && !k(c, f, &v); k = kernel(f.kind)) {
+                    f.kind = widen(f.kind);
+                }
+            }
+        });
+        for (auto const &ch: text) {
+            for (unsigned i = 0; i < ch.fields.size(); ++i) {
+                (*fields)[i].kind = wider((*fields)[i].kind, ch.fields[i].kind);
+            }
+        }
+        for (unsigned i = 0; i < fields->size(); ++i) {
+            Field const &f = (*fields)[i];
+            if (f.kind != fmt.fields[i].kind) {
+                std::cerr << "Field " << f.column << " widened from " << kind_name(fmt.fields[i].kind)
+                          << " to " << kind_name(f.kind) << '.' << std::endl;
+            }
+        }
+    }
+
+    // Converts the data lines of input to Arrow IPC on fd, one record
+    // batch per chunk built in parallel and committed in input order.
+    // Columns take the Arrow type of the field kind, widened first so
+    // every value fits; strings and categoricals are utf8.  Streams can
+    // only be read once, so their numeric fields are float64 and the rest
+    // utf8.  Missing values are null, and so are values that still do
+    // not parse, counted in *failed.  Returns lines skipped.
+    inline size_t convert (string const &input, Format const &fmt, int fd, bool file, size_t *failed) {
+        vector<Field> fields = fmt.fields;
+        if (stream::get(input)) {
+            for (auto &f: fields) {
+                f.kind = (f.type == TYPE_NUMERIC) ? KIND_FLOAT64 : KIND_STRING;
+            }
+        }
+        else {
+            widen_kinds(input, fmt, &fields);
+        }
+        vector<Column> columns;
+        for (auto const &f: fields) {
+            columns.push_back(Column(f));
+        }
+        Output output(fd, file, columns);
+        BigText<Chunk> text(input, fmt.data_offset, '\n', fmt.max_line, 10 * 1024 * 1024, true);
+        text.set_drop_behind(true);
+        text.ordered([&fmt, &fields, &columns](char const *b, char const *e, Chunk *ch) {
+            Batch batch(columns);
+            vector<crange> cols;
+            auto line = [&](char const *lb, char const *le) {
+                if (!fmt.parse(crange(lb, le), &cols)) {
+                    ++ch->bad;
+                    return;
+                }
+                batch.add(cols, fields);
+            };
+            char const *lb = b;
+            structural::for_each(b, e, '\n', [&](char const *p) {
+                line(lb, p + 1);
+                lb = p + 1;
+            });
+            if (lb < e) line(lb, e);
+            batch.serialize(&ch->msg, &ch->meta_len, &ch->body_len);
+            ch->failed = batch.failures();
+        }, [&output](Chunk *ch) {
+            output.batch(ch->msg, ch->meta_len, ch->body_len);
+            string().swap(ch->msg);
+        });
+        output.close();
+        size_t bad = 0;
+        *failed = 0;
+        for (auto const &ch: text) {
+            bad += ch.bad;
+            *failed += ch.failed;
+        }
+        return bad;
+    }
+}}
+
+#endif
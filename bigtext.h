@@ -2,18 +2,28 @@
 #define AAALGO_BIGTEXT
 
 #include <errno.h>
+#include <stdint.h>
 #include <string.h>
 #include <iostream>
-#include <functional>
 #include <vector>
+#include <algorithm>
+#include <deque>
 #include <string>
 #include <utility>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <boost/progress.hpp>
 #include <boost/assert.hpp>
 #include <fcntl.h>
+#include "structural.h"
+#include "stream.h"
+#include "rowindex.h"
 #ifdef USE_OPENMP
 #include <omp.h>
 #endif
@@ -27,8 +37,124 @@ class BigText: public std::vector<T> {
     size_t chunk_size;
     size_t total_size;
     size_t chunks;
+    char const *map;        // whole file when memory-mapped, otherwise nullptr
+    bool drop_behind;
+    bool retain;
+    stream::Source *source; // sequential input, otherwise nullptr
+    std::deque<std::string> kept;   // per-chunk buffers when retaining without a mapping
+    RowIndex *index;        // filled by lines() if set
     std::vector<std::pair<size_t, size_t>> check;
 
+    // page-aligned madvise over [off, off + len) of the mapping
+    void advise (size_t off, size_t len, int advice) const {
+        if (off >= total_size) return;
+        if (off + len > total_size) len = total_size - off;
+        size_t page = sysconf(_SC_PAGESIZE);
+        size_t b = off / page * page;
+        madvise(const_cast<char *>(map) + b, off + len - b, advice);
+    }
+
+    // Reads [off, off + len) of the file into p.
+    void read_at (char *p, size_t len, size_t off) const {
+        while (len) {
+            ssize_t rsz = pread(file, p, len, off);
+            if (rsz <= 0) {
+                std::cerr << "pread(" << file << ", ..., " << len << ", " << off << "): " << (rsz ? strerror(errno) : "short read") << std::endl;
+                BOOST_VERIFY(0);
+            }
+            p += rsz; off += rsz; len -= rsz;
+        }
+    }
+
+    // Offset just past the first delimiter at or after pos, or the file
+    // size if there is none.  Slow path for lines longer than max_line,
+    // which run past the window a chunk is read with.
+    size_t line_end (size_t pos) const {
+        if (map) {
+            char const *p = structural::find(map + pos, map + total_size, delimiter);
+            return p < map + total_size ? p - map + 1 : total_size;
+        }
+        std::vector<char> buf(64 * 1024);
+        while (pos < total_size) {
+            size_t n = std::min(buf.size(), total_size - pos);
+            read_at(&buf[0], n, pos);
+            char const *p = structural::find(&buf[0], &buf[0] + n, delimiter);
+            if (p < &buf[0] + n) return pos + (p - &buf[0]) + 1;
+            pos += n;
+        }
+        return total_size;
+    }
+
+    // Read stage for files read without a mapping.  A thread preads the
+    // chunks in order into kept[], at most `depth` of them ahead of the
+    // ones released, so reading overlaps processing and memory stays
+    // bounded.  Released buffers are reused unless the chunk is kept.
+    class Prefetch {
+        BigText *text;
+        size_t depth;
+        size_t inflight;                // read and not yet released
+        std::vector<ssize_t> sizes;     // -1 until read
+        std::vector<std::string> spare;
+        std::mutex mutex;
+        std::condition_variable cond;
+        std::thread thread;
+
+        void run () {
+            for (size_t i = 0; i < text->chunks; ++i) {
+                std::string buf;
+                {
+                    std::unique_lock<std::mutex> lock(mutex);
+                    cond.wait(lock, [this]() { return inflight < depth; });
+                    ++inflight;
+                    if (spare.size()) {
+                        buf.swap(spare.back());
+                        spare.pop_back();
+                    }
+                }
+                size_t sz = text->chunk_size + text->max_line;
+                off_t off = text->offset + i * text->chunk_size;
+                buf.resize(sz+1);
+                ssize_t rsz = pread(text->file, &buf[0], sz, off);
+                if (rsz < 0) {
+                    std::cerr << "pread(" << text->file << ',' << "..." << ',' << sz << ',' << off << ')' << std::endl;
+                    std::cerr << strerror(errno) << std::endl;
+                    BOOST_VERIFY(0);
+                }
+                std::lock_guard<std::mutex> lock(mutex);
+                text->kept[i].swap(buf);
+                sizes[i] = rsz;
+                cond.notify_all();
+            }
+        }
+
+    public:
+        Prefetch (BigText *t, size_t d): text(t), depth(d), inflight(0), sizes(t->chunks, -1) {
+            text->kept.resize(text->chunks);
+            thread = std::thread([this]() { run(); });
+        }
+
+        ~Prefetch () {
+            thread.join();
+        }
+
+        // waits until chunk i is read; returns its size
+        size_t get (size_t i) {
+            std::unique_lock<std::mutex> lock(mutex);
+            cond.wait(lock, [this, i]() { return sizes[i] >= 0; });
+            return sizes[i];
+        }
+
+        void release (size_t i, bool keep) {
+            std::lock_guard<std::mutex> lock(mutex);
+            --inflight;
+            if (!keep) {
+                spare.push_back(std::string());
+                spare.back().swap(text->kept[i]);
+            }
+            cond.notify_all();
+        }
+    };
+
 public:
     static char const DEFAULT_DELIMITER = '\n';
     static size_t const DEFAULT_MAX_LINE = 4096;
@@ -39,7 +165,17 @@ public:
              size_t off = 0,
              char del = DEFAULT_DELIMITER,
              size_t ml = DEFAULT_MAX_LINE,
-             size_t ch = DEFAULT_MAX_CHUNK): offset(off), delimiter(del), max_line(ml), chunk_size(ch) {
+             size_t ch = DEFAULT_MAX_CHUNK,
+             bool mm = false): offset(off), delimiter(del), max_line(ml), chunk_size(ch), map(nullptr), drop_behind(false), retain(false), index(nullptr) {
+        if (chunk_size < DEFAULT_MIN_CHUNK) chunk_size = DEFAULT_MIN_CHUNK;
+        source = stream::get(path);
+        if (source) {
+            // size and chunks are only known once the input is read
+            file = -1;
+            total_size = 0;
+            chunks = 0;
+            return;
+        }
         file = open(path.c_str(), O_RDONLY);
         BOOST_VERIFY(file >= 0);
         struct stat st;
@@ -47,55 +183,138 @@ public:
         BOOST_VERIFY(r == 0);
         total_size = st.st_size; // - offset;
 
-        if (chunk_size < DEFAULT_MIN_CHUNK) chunk_size = DEFAULT_MIN_CHUNK;
-        BOOST_VERIFY(max_line < chunk_size);
+        // max_line only sizes the read window; longer lines are still
+        // found, just more slowly
+        if (max_line >= chunk_size) max_line = chunk_size - 1;
         chunks = (total_size - offset + chunk_size - 1) / chunk_size;
         this->resize(chunks);
         check.resize(chunks);
+        if (mm && total_size > 0) {
+            void *m = mmap(nullptr, total_size, PROT_READ, MAP_PRIVATE, file, 0);
+            if (m == MAP_FAILED) {
+                std::cerr << "mmap(" << path << "): " << strerror(errno) << ", falling back to pread." << std::endl;
+            }
+            else {
+                map = reinterpret_cast<char const *>(m);
+                advise(0, total_size, MADV_SEQUENTIAL);
+            }
+        }
     }
 
     ~BigText () {
-        close(file);
+        if (map) {
+            munmap(const_cast<char *>(map), total_size);
+        }
+        if (file >= 0) close(file);
+    }
+
+    bool mapped () const {
+        return map != nullptr;
+    }
+
+    // With a mapping, block pointers stay valid for the lifetime of this
+    // object.  Dropping pages behind the cursor keeps RSS flat for
+    // single-pass scans; dropped pages are re-read from the file if
+    // touched again.
+    void set_drop_behind (bool v) {
+        drop_behind = v;
+    }
+
+    // Keep every block readable until this object is destroyed, so
+    // callers can hold pointers into blocks instead of copying lines.
+    // Free with a mapping; otherwise each chunk keeps its own buffer.
+    void set_retain (bool v) {
+        retain = v;
+        if (retain) drop_behind = false;
+    }
+
+    // Have lines() record row offsets into idx.  Only files that can be
+    // read at an offset can be indexed; returns false for streams.
+    bool set_index (RowIndex *idx) {
+        if (source) return false;
+        struct stat st;
+        int r = fstat(file, &st);
+        BOOST_VERIFY(r == 0);
+        idx->stamp(st);
+        idx->delimiter = delimiter;
+        index = idx;
+        return true;
     }
 
-    void blocks (std::function<void(char const *, char const *, T *)> cb) {
+    // Callbacks are template parameters, so they are called directly and
+    // can be inlined into the scanning loops.
+
+    // cb(begin, end, state) once per chunk, in parallel.
+    template <typename F>
+    void blocks (F const &cb) {
+        if (source) {
+            stream_blocks(cb);
+            return;
+        }
         boost::progress_display progress(chunks, std::cerr);
 #ifdef USE_OPENMP
-        std::vector<std::string> bufs(omp_get_max_threads());
-#pragma omp parallel for schedule(dynamic, 1)
+        size_t threads = omp_get_max_threads();
 #else
-        std::string buf;
+        size_t threads = 1;
 #endif
-        for (size_t i = 0; i < chunks; ++i) {
+        // one wave being processed and one being read
+        std::unique_ptr<Prefetch> prefetch;
+        if (!map) {
+            prefetch.reset(new Prefetch(this, 2 * threads));
+        }
+        // chunks are handed out in order, so every chunk read is taken
+        // before a later one is waited for
 #ifdef USE_OPENMP
-            std::string &buf = bufs[omp_get_thread_num()];
+#pragma omp parallel for schedule(dynamic, 1)
 #endif
+        for (size_t i = 0; i < chunks; ++i) {
             size_t sz = chunk_size + max_line;
-            buf.resize(sz+1);
             off_t off = offset + i * chunk_size;
-            ssize_t rsz = pread(file, &buf[0], sz, off);
-            if (rsz < 0) {
-                std::cerr << "pread(" << file << ',' << "..." << ',' << sz << ',' << offset + i * chunk_size << ')' << std::endl;
-                std::cerr << strerror(errno) << std::endl;
-                BOOST_VERIFY(0);
+            char const *data;
+            if (map) {
+                if (off + sz > total_size) sz = total_size - off;
+                data = map + off;
+#ifdef USE_OPENMP
+                size_t ahead = omp_get_num_threads();
+#else
+                size_t ahead = 1;
+#endif
+                advise(off + ahead * chunk_size, chunk_size + max_line, MADV_WILLNEED);
             }
-            sz = rsz;
+            else {
+                sz = prefetch->get(i);
+                data = &kept[i][0];
+            }
+            // Both boundaries are the first delimiter at or after the
+            // chunk's nominal start, so neighbours agree on them.  If a
+            // line runs past the window the boundary is looked up in the
+            // file; a chunk inside one long line comes out empty.
             size_t begin = 0;
             if (i) {
-                while ((begin < sz) && (buf[begin] != delimiter)) ++begin;
-                ++begin;
-                BOOST_VERIFY(begin < max_line);
+                begin = structural::find(data, data + sz, delimiter) - data;
+                if (begin < sz) ++begin;
+                else begin = line_end(off + sz) - off;
             }
-            size_t end = chunk_size;
-            if (sz < chunk_size) {
-                end = sz;
-            }
-            else {
-                while ((end < sz) && (buf[end] != delimiter)) ++end;
+            size_t end = sz;
+            if (sz >= chunk_size) {
+                end = structural::find(data + chunk_size, data + sz, delimiter) - data;
                 if (end < sz) ++end;
+                else end = line_end(off + sz) - off;
+            }
+            if (end > sz && !map) {
+                std::string &buf = kept[i];
+                buf.resize(end + 1);
+                read_at(&buf[sz], end - sz, off + sz);
+                data = &buf[0];
             }
             check[i] = std::make_pair(off + begin, off + end);
-            cb(&buf[begin], &buf[end], &this->at(i));
+            cb(data + begin, data + end, &this->at(i));
+            if (map && drop_behind) {
+                advise(off + begin, end - begin, MADV_DONTNEED);
+            }
+            if (prefetch) {
+                prefetch->release(i, retain);
+            }
 #ifdef USE_OPENMP
 #pragma omp critical
 #endif
@@ -108,22 +327,245 @@ public:
         BOOST_VERIFY(check.back().second == total_size);
     }
 
-    void lines (std::function<void(char const *, char const *, T *, size_t)> cb) {
-        blocks([this, cb](char const *b, char const *e, T *state) {
+    // Like blocks(), but after a chunk is processed commit() is called on
+    // it in chunk order, as soon as all earlier chunks are committed.
+    // Commits are serialized, so they can write to a shared output, and
+    // the block is still readable during its commit.
+    //
+    // A chunk is not started while it is 2 waves or more ahead of the
+    // next one to commit, so a slow chunk holds up the others instead of
+    // letting their results pile up.  Chunks are handed out in order, so
+    // the one holding them up is always being processed.
+    template <typename F, typename C>
+    void ordered (F const &cb, C const &commit) {
+        std::vector<char> done;     // grows with streamed input
+        size_t next = 0;
+#ifdef USE_OPENMP
+        size_t window = 2 * omp_get_max_threads();
+#else
+        size_t window = 2;
+#endif
+        std::mutex mutex;
+        std::condition_variable cond;
+        // commit may still read the block: drop pages after it instead,
+        // and without a mapping give each chunk its own buffer until then
+        bool drop = drop_behind;
+        bool keep = retain;
+        drop_behind = false;
+        retain = true;
+        blocks([&](char const *b, char const *e, T *state) {
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                size_t i = state - &this->at(0);
+                cond.wait(lock, [&]() { return i < next + window; });
+            }
+            cb(b, e, state);
+            std::lock_guard<std::mutex> lock(mutex);
+            if (done.size() < this->size()) done.resize(this->size(), 0);
+            done[state - &this->at(0)] = 1;
+            size_t first = next;
+            while (next < done.size() && done[next]) {
+                commit(&this->at(next));
+                if (map && drop) {
+                    advise(check[next].first, check[next].second - check[next].first, MADV_DONTNEED);
+                }
+                if (!map && !keep) {
+                    std::string().swap(kept[next]);
+                }
+                ++next;
+            }
+            if (next != first) cond.notify_all();
+        });
+        drop_behind = drop;
+        retain = keep;
+    }
+
+    // Sequential input: a reader thread cuts the stream into chunks at
+    // the last delimiter (the partial line is carried into the next
+    // chunk) and queues up to one wave of them, one chunk per thread,
+    // while the previous wave is being processed.
+    template <typename F>
+    void stream_blocks (F const &cb) {
+#ifdef USE_OPENMP
+        size_t wave = omp_get_max_threads();
+#else
+        size_t wave = 1;
+#endif
+        std::mutex mutex;
+        std::condition_variable cond;
+        std::deque<std::string> queue;
+        bool closed = false;
+        std::thread reader([&]() {
+            source->skip(offset);
+            std::string carry;
+            bool eof = false;
+            while (!eof) {
+                std::string buf;
+                buf.swap(carry);
+                size_t have = buf.size();
+                size_t want = chunk_size;
+                size_t last = 0;
+                for (;;) {
+                    if (want <= have) want = have + chunk_size;
+                    buf.resize(want);
+                    have += source->read(&buf[have], want - have);
+                    if (have < want) {
+                        eof = true;
+                        break;
+                    }
+                    void const *p = memrchr(&buf[0], delimiter, have);
+                    if (p) {
+                        last = reinterpret_cast<char const *>(p) - &buf[0] + 1;
+                        break;
+                    }
+                    want *= 2;      // a line longer than a chunk
+                }
+                if (eof) {
+                    buf.resize(have);
+                }
+                else {
+                    carry.assign(buf, last, have - last);
+                    buf.resize(last);
+                }
+                if (buf.empty()) break;
+                std::unique_lock<std::mutex> lock(mutex);
+                cond.wait(lock, [&]() { return queue.size() < wave; });
+                queue.push_back(std::move(buf));
+                cond.notify_all();
+            }
+            std::lock_guard<std::mutex> lock(mutex);
+            closed = true;
+            cond.notify_all();
+        });
+        size_t base = 0;
+        size_t pos = offset;
+        for (;;) {
+            size_t n = 0;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                cond.wait(lock, [&]() { return closed || queue.size() >= wave; });
+                while (queue.size()) {
+                    kept.push_back(std::move(queue.front()));
+                    queue.pop_front();
+                    ++n;
+                }
+                cond.notify_all();
+            }
+            if (n == 0) break;
+            chunks = base + n;
+            this->resize(chunks);
+            check.resize(chunks);
+            for (size_t i = base; i < chunks; ++i) {
+                check[i] = std::make_pair(pos, pos + kept[i].size());
+                pos += kept[i].size();
+            }
+#ifdef USE_OPENMP
+#pragma omp parallel for schedule(dynamic, 1)
+#endif
+            for (size_t i = base; i < chunks; ++i) {
+                cb(&kept[i][0], &kept[i][0] + kept[i].size(), &this->at(i));
+            }
+            if (!retain) {
+                for (size_t i = base; i < chunks; ++i) {
+                    std::string().swap(kept[i]);
+                }
+            }
+            base = chunks;
+        }
+        reader.join();
+        total_size = pos;
+    }
+
+    // Record boundaries of one block.  Record i is [begin(i), end(i)),
+    // without its delimiter.
+    struct Records {
+        char const *base;
+        std::vector<uint32_t> ends;     // delimiter offsets, or the block size
+
+        size_t size () const {
+            return ends.size();
+        }
+
+        char const *begin (size_t i) const {
+            return i ? base + ends[i - 1] + 1 : base;
+        }
+
+        char const *end (size_t i) const {
+            return base + ends[i];
+        }
+    };
+
+    // cb(begin, end, state, i) once per record, i counting records in the
+    // block; end is past the delimiter, if any.
+    template <typename F>
+    void lines (F const &cb) {
+        if (index) {
+            index->blocks.clear();
+            index->blocks.resize(chunks);
+        }
+        blocks([this, &cb](char const *b, char const *e, T *state) {
                 size_t n = 0;
-                while (b < e) {
-                    char const *le = b;
-                    while (le < e && le[0] != delimiter) {
-                        ++le;
+                RowIndex::Block *ib = index_block(state);
+                char const *base = b;
+                structural::for_each(b, e, delimiter, [&](char const *le) {
+                    if (ib && n % index->stride == 0) {
+                        ib->marks.push_back(ib->begin + (b - base));
                     }
-                    if (le < e) {
-                        ++le;
+                    cb(b, le + 1, state, n);
+                    ++n;
+                    b = le + 1;
+                });
+                if (b < e) {
+                    if (ib && n % index->stride == 0) {
+                        ib->marks.push_back(ib->begin + (b - base));
                     }
-                    cb(b, le, state, n);
+                    cb(b, e, state, n);
                     ++n;
-                    b = le;
                 }
+                if (ib) ib->records = n;
+        });
+        if (index) index->finish();
+    }
+
+    // cb(records, state) once per block with all of its record
+    // boundaries, found in one pass before the consumer sees any.
+    template <typename F>
+    void records (F const &cb) {
+        if (index) {
+            index->blocks.clear();
+            index->blocks.resize(chunks);
+        }
+        blocks([this, &cb](char const *b, char const *e, T *state) {
+                BOOST_VERIFY(uint64_t(e - b) <= UINT32_MAX);
+                Records rs;
+                rs.base = b;
+                structural::for_each(b, e, delimiter, [&](char const *le) {
+                    rs.ends.push_back(le - b);
+                });
+                char const *last = rs.ends.empty() ? b : rs.end(rs.size() - 1) + 1;
+                if (last < e) rs.ends.push_back(e - b);
+                RowIndex::Block *ib = index_block(state);
+                if (ib) {
+                    for (size_t n = 0; n < rs.size(); n += index->stride) {
+                        ib->marks.push_back(ib->begin + (rs.begin(n) - b));
+                    }
+                    ib->records = rs.size();
+                }
+                cb(rs, state);
         });
+        if (index) index->finish();
+    }
+
+private:
+    // the index entry of state's block, with its range set; null if not
+    // indexing
+    RowIndex::Block *index_block (T *state) {
+        if (!index) return nullptr;
+        size_t i = state - &this->at(0);
+        RowIndex::Block *ib = &index->blocks[i];
+        ib->begin = check[i].first;
+        ib->end = check[i].second;
+        return ib;
     }
 };
 
@@ -1,5 +1,5 @@
 #include <iostream>
-#include <fstream>
+#include <sstream>
 #include <unordered_set>
 #include <boost/format.hpp>
 #include <boost/algorithm/string/split.hpp>
@@ -9,6 +9,8 @@
 #include <boost/log/trivial.hpp>
 #include <boost/log/utility/setup/console.hpp>
 #include "csvlint.h"
+#define USE_OPENMP 1
+#include "rewrite.h"
 
 using namespace std;
 using namespace boost;
@@ -19,6 +21,7 @@ int main (int argc, char *argv[]) {
     char fs_char;
     unsigned guess_size;
     vector<string> fields;
+    string rows;
     
     string input_path;
     string output_path;
@@ -31,6 +34,7 @@ int main (int argc, char *argv[]) {
     ("fs", po::value(&fs_char), "")
     ("quote", po::value(&quote_char),"")
     ("field,f", po::value(&fields), "")
+    ("rows", po::value(&rows), "FROM:TO, only data records FROM to TO - 1 (from 0), found with the row index saved by csvlint-stat --index")
     ;
     po::options_description desc("Allowed options");
     desc.add(desc_visible);
@@ -63,7 +67,7 @@ int main (int argc, char *argv[]) {
     }
 
     csvlint::Format fmt;
-    fmt.train(input_path, guess_size * 1024 * 1024);
+    fmt.open(input_path, guess_size * 1024 * 1024);
     csvlint::Format tofmt = fmt;
 
     if (vm.count("fs")) {
@@ -89,19 +93,43 @@ int main (int argc, char *argv[]) {
         }
     }
 
-    ofstream os_file;
+    RowIndex index;
+    uint64_t first = 0, last = 0;
+    if (rows.size()) {
+        if (!index.load(RowIndex::sidecar(input_path), input_path)) {
+            cerr << "No up to date row index for " << input_path << ", run csvlint-stat --index first." << endl;
+            return 1;
+        }
+        char colon = 0;
+        istringstream ss(rows);
+        if (!(ss >> first >> colon >> last) || colon != ':' || !ss.eof() || first > last) {
+            cerr << "Bad --rows " << rows << ", expecting FROM:TO." << endl;
+            return 1;
+        }
+        last = min<uint64_t>(last, index.records());
+        first = min(first, last);
+    }
+
+    int fd = STDOUT_FILENO;
     if (output_path.size()) {
-        os_file.open(output_path.c_str());
+        fd = open(output_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+        if (fd < 0) {
+            cerr << "Cannot open " << output_path << ": " << strerror(errno) << endl;
+            return 1;
+        }
+    }
+    size_t bad;
+    if (rows.size()) {
+        bad = csvlint::rewrite_rows(input_path, index, first, last, fmt, tofmt, fd);
+    }
+    else {
+        bad = csvlint::rewrite(input_path, fmt, tofmt, fd);
+    }
+    if (bad) {
+        cerr << bad << " bad lines skipped." << endl;
     }
-    ostream &os = output_path.size() ? os_file : cout;
-    tofmt.write_header(os);
-    ifstream is(input_path);
-    string line;
-    is.seekg(fmt.data_offset);
-    vector<csvlint::crange> cols;
-    while (getline(is, line)) {
-        fmt.parse(csvlint::crange(line), &cols);
-        tofmt.write_line(os, cols);
+    if (fd != STDOUT_FILENO) {
+        close(fd);
     }
     return 0;
 }
@@ -1,9 +1,12 @@
 #include <iostream>
-#include <fstream>
 #include <unordered_set>
 #include <boost/format.hpp>
 #include <boost/program_options.hpp>
+#include <boost/log/utility/setup/console.hpp>
 #include "csvlint.h"
+#define USE_OPENMP 1
+#include "rewrite.h"
+#include "arrow.h"
 
 using namespace std;
 using namespace boost;
@@ -16,6 +19,7 @@ int main (int argc, char *argv[]) {
     
     string input_path;
     string output_path;
+    string arrow;
     po::options_description desc_visible("General options");
     desc_visible.add_options()
     ("help,h", "produce help message.")
@@ -24,6 +28,7 @@ int main (int argc, char *argv[]) {
     (",M", po::value(&guess_size)->default_value(100), "")
     ("fs", po::value(&fs_char)->default_value(','), "")
     ("quote", po::value(&quote_char)->default_value('"'),"")
+    ("arrow", po::value(&arrow), "write Arrow IPC instead of CSV: file or stream")
     ;
     po::options_description desc("Allowed options");
     desc.add(desc_visible);
@@ -42,8 +47,10 @@ int main (int argc, char *argv[]) {
         return 0;
     }
 
+    boost::log::add_console_log(cerr);
+
     csvlint::Format fmt;
-    fmt.train(input_path, guess_size * 1024 * 1024);
+    fmt.open(input_path, guess_size * 1024 * 1024);
     csvlint::Format tofmt = fmt;
 
     if (vm.count("fs")) {
@@ -53,17 +60,36 @@ int main (int argc, char *argv[]) {
         tofmt.quote_char = quote_char;
     }
 
-    ofstream os(output_path);
-    tofmt.write_header(os);
-    ifstream is(input_path);
-    string line;
-    is.seekg(fmt.data_offset);
-    vector<csvlint::crange> cols;
-    while (getline(is, line)) {
-        fmt.parse(csvlint::crange(line), &cols);
-        tofmt.write_line(os, cols);
+    int fd = STDOUT_FILENO;
+    if (output_path.size()) {
+        fd = open(output_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+        if (fd < 0) {
+            cerr << "Cannot open " << output_path << ": " << strerror(errno) << endl;
+            return 1;
+        }
+    }
+    size_t bad;
+    size_t failed = 0;
+    if (arrow.size()) {
+        if (arrow != "file" && arrow != "stream") {
+            cerr << "--arrow must be file or stream." << endl;
+            return 1;
+        }
+        bad = csvlint::ipc::convert(input_path, fmt, fd, arrow == "file", &failed);
+    }
+    else {
+        bad = csvlint::rewrite(input_path, fmt, tofmt, fd);
+    }
+    if (bad) {
+        cerr << bad << " bad lines skipped." << endl;
+    }
+    if (failed) {
+        cerr << failed << " values did not convert and were written as null." << endl;
+    }
+    if (fd != STDOUT_FILENO) {
+        close(fd);
     }
 
-    return 0;
+    return failed ? 1 : 0;
 }
 
@@ -4,6 +4,7 @@
 #include <boost/format.hpp>
 #include <boost/program_options.hpp>
 #include "csvlint.h"
+#include "rowindex.h"
 
 using namespace std;
 using namespace boost;
@@ -14,12 +15,17 @@ int main (int argc, char *argv[]) {
     
     string input_path;
     string output_path;
+    string extra_fs;
+    string extra_quote;
     po::options_description desc_visible("General options");
     desc_visible.add_options()
     ("help,h", "produce help message.")
     ("input,I", po::value(&input_path), "input path")
     ("output,O", po::value(&output_path), "output path")
     (",M", po::value(&guess_size)->default_value(100), "")
+    ("fs", po::value(&extra_fs), "extra field separator candidates")
+    ("quote", po::value(&extra_quote), "extra quote candidates")
+    ("sample-windows", po::value(&csvlint::SAMPLE_WINDOWS)->default_value(csvlint::SAMPLE_WINDOWS), "initial number of sample windows")
     ;
     po::options_description desc("Allowed options");
     desc.add(desc_visible);
@@ -38,9 +44,16 @@ int main (int argc, char *argv[]) {
         return 0;
     }
 
+    csvlint::COMMON_FS.insert(csvlint::COMMON_FS.end(), extra_fs.begin(), extra_fs.end());
+    csvlint::COMMON_QUOTE.insert(csvlint::COMMON_QUOTE.end(), extra_quote.begin(), extra_quote.end());
+
     csvlint::Format fmt;
-    fmt.train(input_path, guess_size * 1024 * 1024);
+    fmt.open(input_path, guess_size * 1024 * 1024);
     fmt.summary(cout, true);
+    RowIndex index;
+    if (index.load(RowIndex::sidecar(input_path), input_path)) {
+        cout << "RECORDS:" << index.records() << endl;
+    }
 
 #if 0
     Format fmt;
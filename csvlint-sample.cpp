@@ -1,7 +1,7 @@
+#include <cmath>
+#include <map>
+#include <queue>
 #include <iostream>
-#include <fstream>
-#include <sstream>
-#include <unordered_map>
 #include <boost/program_options.hpp>
 #include <boost/log/trivial.hpp>
 #include <boost/log/utility/setup/console.hpp>
@@ -9,16 +9,108 @@
 #include "csvlint.h"
 #define USE_OPENMP 1
 #include "bigtext.h"
+#include "intern.h"
 
 using namespace std;
 using namespace boost;
-namespace po = boost::program_options; 
+namespace po = boost::program_options;
+
+// Stratified sampling without holding the input.
+//
+// Every line gets a pseudo-random key hashed from the seed and its
+// position (chunk, line in chunk), so results don't depend on thread
+// scheduling.  Keeping the lines with the smallest keys of a stratum is
+// a uniform sample of it.
+//
+//  exact:     pass 1 counts strata; pass 2 keeps the round(n * rate)
+//             (at least 1) smallest keys of each stratum.
+//  bernoulli: one pass, keeps lines whose key is below rate, plus the
+//             smallest key of each stratum so none comes out empty.
+//             Works on streams.
+//
+// Chunks are parsed in parallel and their selections merged as each
+// chunk finishes, so memory is proportional to the output.
+
+uint64_t mix (uint64_t x) {
+    x += 0x9e3779b97f4a7c15ULL;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+}
+
+typedef pair<uint64_t, string> Row;     // key, line without '\n'
+
+// the `limit` rows with the smallest keys seen so far
+struct Stratum {
+    size_t count;
+    size_t limit;
+    priority_queue<Row> rows;           // largest key on top
+
+    Stratum (): count(0), limit(0) {
+    }
+
+    bool wants (uint64_t key) const {
+        return rows.size() < limit || key < rows.top().first;
+    }
+
+    void add (uint64_t key, char const *b, char const *e) {
+        rows.push(Row(key, string(b, e)));
+        if (rows.size() > limit) rows.pop();
+    }
+
+    void merge (Stratum *s) {
+        count += s->count;
+        while (s->rows.size()) {
+            Row const &r = s->rows.top();
+            if (wants(r.first)) {
+                rows.push(std::move(const_cast<Row &>(r)));
+                if (rows.size() > limit) rows.pop();
+            }
+            s->rows.pop();
+        }
+    }
+};
+
+// by key value
+typedef InternTable<Stratum> Strata;
+
+struct Chunk {
+    Strata strata;
+    Strata picked;                      // bernoulli: lines below the rate
+    vector<csvlint::crange> cols;
+};
+
+// Runs f(chunk, key, value, begin, end) on every parsable line with a value
+// in the key field, and merge(chunk) under a lock after every chunk.
+template <typename F, typename M>
+void scan (string const &input, csvlint::Format const &fmt, unsigned key, uint64_t seed, F const &f, M const &merge) {
+    BigText<Chunk> text(input, fmt.data_offset, '\n', fmt.max_line, 10 * 1024 * 1024, true);
+    text.set_drop_behind(true);
+    text.records([&](BigText<Chunk>::Records const &rs, Chunk *ch) {
+        uint64_t id = uint64_t(ch - &text[0]) << 32;
+        for (size_t i = 0; i < rs.size(); ++i) {
+            char const *lb = rs.begin(i);
+            char const *le = rs.end(i);
+            uint64_t k = mix(seed ^ mix(id++));
+            if (!fmt.parse(csvlint::crange(lb, le), &ch->cols)) continue;
+            csvlint::crange v = ch->cols[key];
+            if (v.missing()) continue;
+            f(ch, k, v, lb, le);
+        }
+#pragma omp critical(sample_merge)
+        merge(ch);
+        ch->strata.clear();
+        ch->picked.clear();
+    });
+}
 
 int main (int argc, char *argv[]) {
     unsigned guess_size;
     float rate;
     unsigned key;
-    
+    uint64_t seed;
+    string mode;
+
     string input_path;
     string output_path;
     po::options_description desc_visible("General options");
@@ -28,6 +120,8 @@ int main (int argc, char *argv[]) {
     ("output,O", po::value(&output_path), "output path")
     ("rate,r", po::value(&rate)->default_value(0.1), "")
     ("key", po::value(&key), "stratify by this field")
+    ("mode", po::value(&mode)->default_value("exact"), "exact or bernoulli")
+    ("seed", po::value(&seed)->default_value(0), "")
     (",M", po::value(&guess_size)->default_value(10), "")
     ;
     po::options_description desc("Allowed options");
@@ -37,9 +131,9 @@ int main (int argc, char *argv[]) {
     p.add("input", 1);
     p.add("output", 1);
 
-    po::variables_map vm; 
+    po::variables_map vm;
     po::store(po::command_line_parser(argc, argv).options(desc).positional(p).run(), vm);
-    po::notify(vm); 
+    po::notify(vm);
 
     if (vm.count("help") || vm.count("input") == 0 || vm.count("output") == 0 || vm.count("key") == 0) {
         cout << "Usage: csvlint-sample [OTHER OPTIONS]... <input> <output>" << endl;
@@ -52,39 +146,108 @@ int main (int argc, char *argv[]) {
     boost::log::add_console_log(cerr);
 
     csvlint::Format fmt;
-    fmt.train(input_path, guess_size * 1024 * 1024);
+    fmt.open(input_path, guess_size * 1024 * 1024);
     BOOST_VERIFY(key < fmt.fields.size());
 
-    unordered_map<string, vector<string>> all;
+    if (mode == "exact" && stream::get(input_path)) {
+        LOG(warning) << "input can only be read once, using bernoulli sampling.";
+        mode = "bernoulli";
+    }
 
-    ifstream is(input_path.c_str());
-    is.seekg(fmt.data_offset);
-    BOOST_VERIFY(is);
-    string line;
-    vector<csvlint::crange> cols;
-    while (getline(is, line)) {
-        if (!fmt.parse(csvlint::crange(std::ref(line)), &cols)) continue;
-        csvlint::crange e = cols[key];
-        if (e.missing()) continue;
-        all[string(e.begin(), e.end())].push_back(line);
+    Strata all;
+    if (mode == "exact") {
+        // pass 1: stratum sizes
+        scan(input_path, fmt, key, seed, [](Chunk *ch, uint64_t, csvlint::crange v, char const *, char const *) {
+            ++ch->strata.insert(v.begin(), v.size()).first->value.count;
+        }, [&all](Chunk *ch) {
+            ch->strata.for_each([&all](Strata::Slot const &p) {
+                all.insert(p.data, p.size, p.hash).first->value.count += p.value.count;
+            });
+        });
+        all.for_each([rate](Strata::Slot &p) {
+            Stratum &s = p.value;
+            s.limit = round(s.count * rate);
+            if (s.limit == 0) s.limit = 1;
+            if (s.limit > s.count) s.limit = s.count;
+            s.count = 0;
+        });
+        // pass 2: smallest keys, bounded per chunk by the global limit
+        // every key is in all by now: merges only find() their strata, so
+        // all is never rehashed while workers look up limits in it
+        scan(input_path, fmt, key, seed, [&all](Chunk *ch, uint64_t k, csvlint::crange v, char const *b, char const *e) {
+            Stratum &s = ch->strata.insert(v.begin(), v.size()).first->value;
+            if (s.limit == 0) s.limit = all.find(v.begin(), v.size())->value.limit;
+            if (s.wants(k)) s.add(k, b, e);
+        }, [&all](Chunk *ch) {
+            ch->strata.for_each([&all](Strata::Slot &p) {
+                all.find(p.data, p.size, p.hash)->value.merge(&p.value);
+            });
+        });
+    }
+    else if (mode == "bernoulli") {
+        uint64_t cut = uint64_t(ldexp(rate, 64));
+        // limit 1 keeps the smallest key; the rest goes to `picked`
+        Strata picked;
+        scan(input_path, fmt, key, seed, [cut](Chunk *ch, uint64_t k, csvlint::crange v, char const *b, char const *e) {
+            if (k < cut) {
+                Stratum &s = ch->picked.insert(v.begin(), v.size()).first->value;
+                s.limit = size_t(-1);
+                s.add(k, b, e);
+            }
+            else {
+                Stratum &s = ch->strata.insert(v.begin(), v.size()).first->value;
+                s.limit = 1;
+                if (s.wants(k)) s.add(k, b, e);
+            }
+        }, [&](Chunk *ch) {
+            auto fold = [](Strata *to, Strata *from) {
+                from->for_each([to](Strata::Slot &p) {
+                    Stratum &s = to->insert(p.data, p.size, p.hash).first->value;
+                    s.limit = p.value.limit;
+                    s.merge(&p.value);
+                });
+            };
+            fold(&picked, &ch->picked);
+            fold(&all, &ch->strata);
+        });
+        picked.for_each([&all](Strata::Slot &p) {
+            Stratum &s = all.insert(p.data, p.size, p.hash).first->value;
+            s.limit = size_t(-1);
+            s.rows = std::move(p.value.rows);
+        });
+    }
+    else {
+        cerr << "Unknown mode " << mode << '.' << endl;
+        return 1;
     }
 
-    ofstream os(output_path.c_str());
-
-    fmt.write_header(os);
-    for (auto &p: all) {
-        auto &v = p.second;
-        size_t use = round(v.size() * rate);
-        if (use == 0) use = 1;
-        if (use > v.size()) use = v.size();
-        random_shuffle(v.begin(), v.end());
-        for (size_t i = 0; i < use; ++i) {
-            os.write(&v[i][0], v[i].size());
-            os.put('\n');
+    int fd = open(output_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd < 0) {
+        cerr << "Cannot open " << output_path << ": " << strerror(errno) << endl;
+        return 1;
+    }
+    {
+        csvlint::Writer os(fd);
+        fmt.write_header(os);
+        map<string, Stratum *> order;
+        all.for_each([&order](Strata::Slot &p) {
+            order[p.key()] = &p.value;
+        });
+        for (auto &p: order) {
+            auto &rows = p.second->rows;
+            vector<Row> v;
+            v.reserve(rows.size());
+            while (rows.size()) {
+                v.push_back(std::move(const_cast<Row &>(rows.top())));
+                rows.pop();
+            }
+            for (auto it = v.rbegin(); it != v.rend(); ++it) {
+                os.write(it->second);
+                os.put('\n');
+            }
         }
     }
-
-
+    close(fd);
 
     return 0;
 }
@@ -3,11 +3,6 @@
 #include <sstream>
 #include <unordered_map>
 #include <boost/format.hpp>
-#include <boost/accumulators/accumulators.hpp>
-#include <boost/accumulators/statistics/stats.hpp>
-#include <boost/accumulators/statistics/mean.hpp>
-#include <boost/accumulators/statistics/variance.hpp>
-#include <boost/spirit/include/qi.hpp>
 #include <boost/progress.hpp>
 #include <boost/program_options.hpp>
 #include <boost/log/trivial.hpp>
@@ -16,26 +11,43 @@
 #include "csvlint.h"
 #define USE_OPENMP 1
 #include "bigtext.h"
+#include "spill.h"
+#include "reduce.h"
 
 using namespace std;
 using namespace boost;
 namespace po = boost::program_options; 
-namespace ba = boost::accumulators;
-namespace qi = boost::spirit::qi;
-typedef ba::accumulator_set<double, ba::stats<ba::tag::mean, ba::tag::variance>> Acc;
 
 size_t topk = 20;
 
+// Value counts of one column over the lines one thread parsed; merge()
+// folds in another thread's.  Distinct values count against --max-memory.
 struct Column {
-    vector<csvlint::crange> strings;
     size_t missing;
+    unsigned max_len;
+    spill::Counter strings;
+
+    Column (): missing(0), max_len(0) {
+    }
+
+    void add (csvlint::crange e) {
+        strings.add(e.begin(), e.size());
+        if (e.size() > max_len) {
+            max_len = e.size();
+        }
+    }
+
+    void merge (Column &o) {
+        missing += o.missing;
+        max_len = max(max_len, o.max_len);
+        strings.merge(o.strings);
+    }
 };
 
 struct Chunk {
-    vector<string> lines;
     vector<csvlint::crange> cols;
-    vector<Column> data;
     size_t total;
+    size_t good;
 };
 
 size_t total (vector<Chunk> const &chunks) {
@@ -49,12 +61,12 @@ size_t total (vector<Chunk> const &chunks) {
 size_t good (vector<Chunk> const &chunks) {
     size_t v = 0;
     for (auto const &ch: chunks) {
-        v += ch.data.size();
+        v += ch.good;
     }
     return v;
 }
 
-unsigned c999 (string const &s) {
+unsigned c999 (csvlint::crange s) {
     unsigned i = 0; 
     while (i < s.size() && s[i] == '9') {
         ++i;
@@ -62,50 +74,35 @@ unsigned c999 (string const &s) {
     return i;
 }
 
-void stat_number (csvlint::Field const &f,  vector<Chunk> const &chunks, string *out) {
-    unordered_map<string, size_t> cnts;
-    unsigned col = f.column;
-    size_t missing = 0;
-    unsigned max_len = 0;
-    for (auto const &ch: chunks) {
-        for (auto e: ch.data[col].strings) {
-            ++cnts[string(e.begin(), e.end())];
-            unsigned sz = e.end() - e.begin();
-            if (sz > max_len) {
-                max_len = sz;
-            }
+void stat_number (csvlint::Field const &f, Column &c, string *out) {
+    size_t missing = c.missing;
+    unsigned max_len = c.max_len;
+    size_t values = 0;
+    string minus;
+    unsigned minuses = 0;
+    vector<string> nines;
+    c.strings.visit([&](char const *p, size_t len, size_t) {
+        csvlint::crange v(p, p + len);
+        ++values;
+        if (v.empty()) return;
+        if (v[0] == '-') {
+            if (minuses++ == 0) minus = string(v.begin(), v.end());
         }
-        missing += ch.data[col].missing;
-    }
-    if ((missing > 0) && (cnts.size() <= 1)) return;
-    if ((missing == 0) && (cnts.size() <= 2)) return;
+        unsigned n = c999(v);
+        if (n < 2) return;
+        if (n + 1 < max_len) return;
+        if (v.size() < max_len) return;
+        nines.push_back(string(v.begin(), v.end()));
+    });
+    if ((missing > 0) && (values <= 1)) return;
+    if ((missing == 0) && (values <= 2)) return;
     vector<string> special;
-    
-    {
-        string minus;
-        for (auto const &e: cnts) {
-            if (e.first.empty()) continue;
-            if (e.first[0] == '-') {
-                if (minus.size()) goto pass;
-                minus = e.first;
-            }
-        }
-        if (minus.size()) {
-            special.push_back(minus);
-        }
-pass:;
-    }
-
-    {
-        for (auto const &e: cnts) {
-            if (e.first.empty()) continue;
-            unsigned c = c999(e.first);
-            if (c < 2) continue;
-            if (c + 1 < max_len) continue;
-            if (e.first.size() < max_len) continue;
-            special.push_back(e.first);
-        }
+    // a lone negative value is likely a placeholder
+    if (minuses == 1) {
+        special.push_back(minus);
     }
+    sort(nines.begin(), nines.end());
+    special.insert(special.end(), nines.begin(), nines.end());
     if (special.empty() && missing == 0) return;
     ostringstream ss;
     if (missing) {
@@ -117,57 +114,47 @@ pass:;
     *out = ss.str();
 }
 
-void stat_string (csvlint::Field const &f, vector<Chunk> const &chunks, string *out, char C='S') {
-    unordered_map<string, size_t> cnts;
-    unsigned col = f.column;
-    size_t missing = 0;
-    for (auto const &ch: chunks) {
-        for (auto e: ch.data[col].strings) {
-            ++cnts[string(e.begin(), e.end())];
+void stat_string (csvlint::Field const &f, Column &c, string *out, char C='S') {
+    size_t missing = c.missing;
+    size_t values = 0;
+    // placeholders reported if present
+    vector<string> const placeholders{"", "-1", "NA", "N/A"};
+    vector<bool> seen(placeholders.size(), false);
+    c.strings.visit([&](char const *p, size_t len, size_t) {
+        ++values;
+        for (unsigned i = 0; i < placeholders.size(); ++i) {
+            if (placeholders[i].compare(0, string::npos, p, len) == 0) seen[i] = true;
         }
-        missing += ch.data[col].missing;
-    }
-    if ((missing > 0) && (cnts.size() <= 1)) return;
-    if ((missing == 0) && (cnts.size() <= 2)) return;
+    });
+    if ((missing > 0) && (values <= 1)) return;
+    if ((missing == 0) && (values <= 2)) return;
     int sp = 0;
     ostringstream ss;
-    size_t n = cnts[""];
-    if (n> 0) {
-        ss << f.name << "\t\"\"" << endl;
-        ++sp;
-    }
-    n = cnts["-1"];
-    if (n> 0) {
-        ss << f.name << "\t\"-1\"" << endl;
-        ++sp;
-    }
-    n = cnts["NA"];
-    if (n> 0) {
-        ss << f.name << "\t\"NA\"" << endl;
-        ++sp;
-    }
-    n = cnts["N/A"];
-    if (n> 0) {
-        ss << f.name << "\t\"N/A\"" << endl;
-        ++sp;
+    for (unsigned i = 0; i < placeholders.size(); ++i) {
+        if (seen[i]) {
+            ss << f.name << "\t\"" << placeholders[i] << '"' << endl;
+            ++sp;
+        }
     }
     if (sp) {
         *out = ss.str();
     }
 }
 
-void stat_column (csvlint::Field const &f, vector<Chunk> const &chunks, string *out) {
+void stat_column (csvlint::Field const &f, Column &c, string *out) {
     if (f.type == csvlint::TYPE_NUMERIC) {
-        stat_number(f, chunks, out);
+        stat_number(f, c, out);
     }
     else if (f.type == csvlint::TYPE_STRING) {
-        stat_string(f, chunks, out);
+        stat_string(f, c, out);
     }
     else BOOST_VERIFY(0);
 }
 
 int main (int argc, char *argv[]) {
     unsigned guess_size;
+    size_t max_memory;
+    string tmp_dir;
     
     string input_path;
     string output_path;
@@ -177,6 +164,10 @@ int main (int argc, char *argv[]) {
     ("input,I", po::value(&input_path), "input path")
     (",M", po::value(&guess_size)->default_value(10), "")
     ("topk", po::value(&topk)->default_value(topk), "")
+    ("max-memory", po::value(&max_memory)->default_value(0), "MB of distinct values to hold before spilling to disk, 0 for no limit")
+    ("tmp-dir", po::value(&tmp_dir)->default_value("/tmp"), "where to spill")
+    ("no-mmap", "read with pread instead of mmap")
+    ("index", "save record offsets to <input>.rows")
     ;
     po::options_description desc("Allowed options");
     desc.add(desc_visible);
@@ -195,33 +186,44 @@ int main (int argc, char *argv[]) {
     }
 
     boost::log::add_console_log(cerr);
+    spill::setup(max_memory * 1024 * 1024, tmp_dir);
 
     csvlint::Format fmt;
-    fmt.train(input_path, guess_size * 1024 * 1024);
+    fmt.open(input_path, guess_size * 1024 * 1024);
+
+    // every thread holds a counter per column
+    spill::share(omp_get_max_threads() * fmt.fields.size());
 
     cerr << "Parsing text..." << endl;
-    BigText<Chunk> text(input_path, fmt.data_offset, '\n', fmt.max_line, 10 * 1024*1024);
+    BigText<Chunk> text(input_path, fmt.data_offset, '\n', fmt.max_line, 10 * 1024*1024, vm.count("no-mmap") == 0);
 
     for (auto &ch: text) {
         ch.total = 0;
-        ch.data.resize(fmt.fields.size());
-        for (auto &v: ch.data) {
-            v.missing = 0;
-        }
+        ch.good = 0;
     }
-    text.lines ([&fmt](char const *begin, char const *end, Chunk *ch, size_t i_in_block) {
+    // one set of columns per thread, filled by the lines it parses
+    vector<vector<Column>> parts(omp_get_max_threads());
+    for (auto &part: parts) {
+        part.resize(fmt.fields.size());
+    }
+    // lines are counted as they are parsed, nothing refers back to them
+    text.set_drop_behind(true);
+    RowIndex index;
+    bool indexing = vm.count("index") && text.set_index(&index);
+    text.lines ([&fmt, &parts](char const *begin, char const *end, Chunk *ch, size_t i_in_block) {
         auto &cols = ch->cols;
-        ch->lines.emplace_back(begin, end);
-        bool r = fmt.parse(csvlint::crange(std::ref(ch->lines.back())), &cols);
+        bool r = fmt.parse(csvlint::crange(begin, end), &cols);
         if (r) {
+            ++ch->good;
+            vector<Column> &part = parts[omp_get_thread_num()];
             for (unsigned i = 0; i < fmt.fields.size(); ++i) {
-                Column &data = ch->data[i];
+                Column &data = part[i];
                 csvlint::crange e = cols[i];
                 if (e.missing()) {
                     ++data.missing;
                 }
                 else {
-                    data.strings.push_back(e);
+                    data.add(e);
                 }
             }
         }
@@ -229,15 +231,22 @@ int main (int argc, char *argv[]) {
     });
 
     cerr << total(text) << " total lines." << endl;
+    if (indexing && !index.save(RowIndex::sidecar(input_path))) {
+        LOG(warning) << "cannot save " << RowIndex::sidecar(input_path) << '.';
+    }
     cerr << good(text) << " good lines." << endl;
 
+    cerr << "Merging chunks..." << endl;
+    reduce(parts, fmt.fields.size());
+    vector<Column> &all = parts[0];
+
     vector<string> stats(fmt.fields.size());
 
     cerr << "Counting numbers..." << endl;
     progress_display progress(fmt.fields.size(), cerr);
 #pragma omp parallel for
     for (unsigned i = 0; i < fmt.fields.size(); ++i) {
-        stat_column(fmt.fields[i], text, &stats[i]);
+        stat_column(fmt.fields[i], all[i], &stats[i]);
 #pragma omp critical
         ++progress;
     }
@@ -246,6 +255,7 @@ int main (int argc, char *argv[]) {
         if (st.empty()) continue;
         cout << st;
     }
+    spill::cleanup();
 
     return 0;
 }
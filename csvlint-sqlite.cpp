@@ -1,25 +1,213 @@
 #include <iostream>
 #include <fstream>
+#include <sstream>
 #include <unordered_set>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sqlite3.h>
 #include <boost/format.hpp>
 #include <boost/program_options.hpp>
+#include <boost/log/utility/setup/console.hpp>
 #include "csvlint.h"
+#define USE_OPENMP 1
+#include "bigtext.h"
 
 using namespace std;
 using namespace boost;
 namespace po = boost::program_options; 
 
-ostream &write_sql_string (ostream &os, csvlint::crange e) {
-    os.put('\'');
-    for (char const *i = e.begin(); i != e.end(); ++i) {
-        char c = *i;
-        if (c == '\'') {
-            os.put('\'');
+void write_sql_string (csvlint::Writer &w, csvlint::crange e) {
+    w.put('\'');
+    char const *b = e.begin();
+    for (;;) {
+        char const *q = reinterpret_cast<char const *>(memchr(b, '\'', e.end() - b));
+        if (!q) break;
+        w.write(b, q + 1 - b);  // double the quote
+        w.put('\'');
+        b = q + 1;
+    }
+    w.write(b, e.end() - b);
+    w.put('\'');
+}
+
+string create_table (csvlint::Format const &fmt, string const &table_name, bool use_column_name) {
+    ostringstream os;
+    os << "create table " << table_name << '(';
+    for (unsigned i = 0; i < fmt.fields.size(); ++i) {
+        if (i) os << ", ";
+        auto const &field = fmt.fields[i];
+        if (field.name.size() && use_column_name) {
+            if (field.name.size() > 2
+                && field.name.front() == fmt.quote_char
+                && field.name.back() == fmt.quote_char) {
+                os << field.name.substr(1, field.name.size()-2);
+            }
+            else {
+                os << field.name;
+            }
+        }
+        else {
+            os << "c" << i;
+        }
+        if (field.type == csvlint::TYPE_NUMERIC) {
+            os << " real";
+        }
+        else {
+            os << " text";
         }
-        os.put(*i);
     }
-    os.put('\'');
-    return os;
+    os << ")";
+    return os.str();
+}
+
+struct SqlChunk {
+    string out;
+    size_t bad;
+};
+
+// Writes the input as SQL statements on fd.  Chunks are formatted in
+// parallel, each into its own buffer, and written in input order.  Lines
+// that fail to parse are skipped; returns their number.
+size_t write_sql (string const &input_path, csvlint::Format const &fmt, string const &table_name, int fd) {
+    string const insert = "insert into " + table_name + " values(";
+    BigText<SqlChunk> text(input_path, fmt.data_offset, '\n', fmt.max_line, 10 * 1024 * 1024, true);
+    text.set_drop_behind(true);
+    text.ordered([&](char const *b, char const *e, SqlChunk *ch) {
+        csvlint::Writer os(-1, (e - b) * 2);
+        vector<csvlint::crange> cols;
+        auto line = [&](char const *lb, char const *le) {
+            if (!fmt.parse(csvlint::crange(lb, le), &cols)) {
+                ++ch->bad;
+                return;
+            }
+            os.write(insert);
+            for (unsigned i = 0; i < fmt.fields.size(); ++i) {
+                if (i) os.write(", ", 2);
+                auto const &field = fmt.fields[i];
+                auto e = cols[i];
+                if (e.missing()) {
+                    os.write("null", 4);
+                }
+                else if (field.type == csvlint::TYPE_NUMERIC) {
+                    os.write(e);
+                }
+                else {
+                    write_sql_string(os, e);
+                }
+            }
+            os.write(");\n", 3);
+        };
+        char const *lb = b;
+        structural::for_each(b, e, '\n', [&](char const *p) {
+            line(lb, p + 1);
+            lb = p + 1;
+        });
+        if (lb < e) line(lb, e);
+        ch->out.swap(os.buffer());
+    }, [fd](SqlChunk *ch) {
+        csvlint::write_fully(fd, ch->out.data(), ch->out.size());
+        string().swap(ch->out);
+    });
+    size_t bad = 0;
+    for (auto const &ch: text) {
+        bad += ch.bad;
+    }
+    return bad;
+}
+
+struct LoadChunk {
+    vector<csvlint::crange> cells;  // rows x columns
+    size_t bad;
+};
+
+void check (sqlite3 *db, int r, char const *what) {
+    if (r == SQLITE_OK || r == SQLITE_DONE || r == SQLITE_ROW) return;
+    cerr << what << ": " << sqlite3_errmsg(db) << endl;
+    BOOST_VERIFY(0);
+}
+
+// Loads the input straight into a database through a prepared INSERT.
+// Lines are parsed in parallel per BigText chunk; the ordered commit is
+// the single writer binding rows, with a transaction every batch rows
+// (one for all of them if batch is 0).
+int load_db (string const &input_path, csvlint::Format const &fmt, string const &db_path,
+             string const &table_name, bool use_column_name, size_t batch) {
+    sqlite3 *db;
+    if (sqlite3_open(db_path.c_str(), &db) != SQLITE_OK) {
+        cerr << "Cannot open " << db_path << ": " << sqlite3_errmsg(db) << endl;
+        return 1;
+    }
+    // bulk load: no rollback journal, no fsync
+    check(db, sqlite3_exec(db, "pragma journal_mode = off; pragma synchronous = off;"
+                               "pragma temp_store = memory; pragma cache_size = -262144;",
+                           nullptr, nullptr, nullptr), "pragma");
+    check(db, sqlite3_exec(db, create_table(fmt, table_name, use_column_name).c_str(),
+                           nullptr, nullptr, nullptr), "create table");
+    string sql = "insert into " + table_name + " values(";
+    for (unsigned i = 0; i < fmt.fields.size(); ++i) {
+        if (i) sql += ", ";
+        sql += '?';
+    }
+    sql += ")";
+    sqlite3_stmt *stmt;
+    check(db, sqlite3_prepare_v2(db, sql.c_str(), -1, &stmt, nullptr), "prepare");
+    check(db, sqlite3_exec(db, "begin transaction", nullptr, nullptr, nullptr), "begin");
+
+    unsigned columns = fmt.fields.size();
+    size_t rows = 0;
+    BigText<LoadChunk> text(input_path, fmt.data_offset, '\n', fmt.max_line, 10 * 1024 * 1024, true);
+    text.set_drop_behind(true);
+    text.ordered([&fmt](char const *b, char const *e, LoadChunk *ch) {
+        vector<csvlint::crange> cols;
+        auto line = [&](char const *lb, char const *le) {
+            if (!fmt.parse(csvlint::crange(lb, le), &cols)) {
+                ++ch->bad;
+                return;
+            }
+            ch->cells.insert(ch->cells.end(), cols.begin(), cols.end());
+        };
+        char const *lb = b;
+        structural::for_each(b, e, '\n', [&](char const *p) {
+            line(lb, p + 1);
+            lb = p + 1;
+        });
+        if (lb < e) line(lb, e);
+    }, [&](LoadChunk *ch) {
+        for (size_t off = 0; off < ch->cells.size(); off += columns) {
+            for (unsigned i = 0; i < columns; ++i) {
+                auto const &e = ch->cells[off + i];
+                int r;
+                if (e.missing()) {
+                    r = sqlite3_bind_null(stmt, i + 1);
+                }
+                else {
+                    // numeric text is converted by the column's real affinity
+                    r = sqlite3_bind_text(stmt, i + 1, e.begin(), e.size(), SQLITE_STATIC);
+                }
+                check(db, r, "bind");
+            }
+            check(db, sqlite3_step(stmt), "insert");
+            sqlite3_reset(stmt);
+            ++rows;
+            if (batch && rows % batch == 0) {
+                check(db, sqlite3_exec(db, "commit; begin transaction", nullptr, nullptr, nullptr), "commit");
+            }
+        }
+        vector<csvlint::crange>().swap(ch->cells);
+    });
+    check(db, sqlite3_exec(db, "commit", nullptr, nullptr, nullptr), "commit");
+    sqlite3_finalize(stmt);
+    sqlite3_close(db);
+    size_t bad = 0;
+    for (auto const &ch: text) {
+        bad += ch.bad;
+    }
+    cerr << rows << " rows loaded." << endl;
+    if (bad) {
+        cerr << bad << " bad lines skipped." << endl;
+    }
+    return 0;
 }
 
 int main (int argc, char *argv[]) {
@@ -29,12 +217,16 @@ int main (int argc, char *argv[]) {
     
     string input_path;
     string output_path;
+    string db_path;
+    size_t batch;
     po::options_description desc_visible("General options");
     desc_visible.add_options()
     ("help,h", "produce help message.")
     ("input,I", po::value(&input_path), "input path")
     ("output,O", po::value(&output_path), "output path")
     ("table,t", po::value(&table_name)->default_value("data"), "")
+    ("db", po::value(&db_path), "load into this sqlite database instead of writing SQL")
+    ("batch", po::value(&batch)->default_value(1000000), "rows per transaction with --db, 0 for a single transaction")
     ("use-column-name", "")
     (",M", po::value(&guess_size)->default_value(100), "")
     ;
@@ -57,65 +249,40 @@ int main (int argc, char *argv[]) {
 
     use_column_name = vm.count("use_column_name") > 0;
 
+    boost::log::add_console_log(cerr);
+
     csvlint::Format fmt;
-    fmt.train(input_path, guess_size * 1024 * 1024);
+    fmt.open(input_path, guess_size * 1024 * 1024);
     csvlint::Format tofmt = fmt;
 
-    ofstream os(output_path);
-    // write header
-    os << "begin transaction;" << endl;
-    os << "create table " << table_name << '(';
+    if (db_path.size()) {
+        return load_db(input_path, fmt, db_path, table_name, use_column_name, batch);
+    }
 
-    for (unsigned i = 0; i < fmt.fields.size(); ++i) {
-        if (i) os << ", ";
-        auto const &field = fmt.fields[i];
-        if (field.name.size() && use_column_name) {
-            if (field.name.size() > 2
-                && field.name.front() == fmt.quote_char
-                && field.name.back() == fmt.quote_char) {
-                os << field.name.substr(1, field.name.size()-2);
-            }
-            else {
-                os << field.name;
-            }
-        }
-        else {
-            os << "c" << i;
-        }
-        if (field.type == csvlint::TYPE_NUMERIC) {
-            os << " real";
-        }
-        else {
-            os << " text";
+    int fd = STDOUT_FILENO;
+    if (output_path.size()) {
+        fd = open(output_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+        if (fd < 0) {
+            cerr << "Cannot open " << output_path << ": " << strerror(errno) << endl;
+            return 1;
         }
     }
-    os << ");" << endl;
-
-    ifstream is(input_path.c_str());
-    is.seekg(fmt.data_offset);
-    BOOST_VERIFY(is);
-    string line;
-    vector<csvlint::crange> cols;
-    while (getline(is, line)) {
-        fmt.parse(csvlint::crange(line), &cols);
-        os << "insert into " << table_name << " values(";
-        for (unsigned i = 0; i < fmt.fields.size(); ++i) {
-            if (i) os << ", ";
-            auto const &field = fmt.fields[i];
-            auto e = cols[i];
-            if (e.missing()) {
-                os << "null";
-            }
-            else if (field.type == csvlint::TYPE_NUMERIC) {
-                os << e;
-            }
-            else {
-                write_sql_string(os, e);
-            }
-        }
-        os << ");" << endl;
+    {
+        csvlint::Writer os(fd);
+        os.write("begin transaction;\n");
+        os.write(create_table(fmt, table_name, use_column_name) + ";\n");
+    }
+    size_t bad = write_sql(input_path, fmt, table_name, fd);
+    {
+        csvlint::Writer os(fd);
+        os.write("commit;\n");
+    }
+    if (bad) {
+        cerr << bad << " bad lines skipped." << endl;
+    }
+    if (fd != STDOUT_FILENO) {
+        close(fd);
     }
-    os << "commit;" << endl;
 
     return 0;
 }
@@ -1,13 +1,9 @@
 #include <iostream>
 #include <fstream>
 #include <sstream>
+#include <queue>
 #include <unordered_map>
 #include <boost/format.hpp>
-#include <boost/accumulators/accumulators.hpp>
-#include <boost/accumulators/statistics/stats.hpp>
-#include <boost/accumulators/statistics/mean.hpp>
-#include <boost/accumulators/statistics/variance.hpp>
-#include <boost/spirit/include/qi.hpp>
 #include <boost/progress.hpp>
 #include <boost/program_options.hpp>
 #include <boost/log/trivial.hpp>
@@ -16,27 +12,140 @@
 #include "csvlint.h"
 #define USE_OPENMP 1
 #include "bigtext.h"
+#include "sketch.h"
+#include "number.h"
+#include "spill.h"
+#include "arena.h"
+#include "reduce.h"
 
 using namespace std;
 using namespace boost;
 namespace po = boost::program_options; 
-namespace ba = boost::accumulators;
-namespace qi = boost::spirit::qi;
-typedef ba::accumulator_set<double, ba::stats<ba::tag::mean, ba::tag::variance>> Acc;
 
 size_t topk = 20;
+bool approx = false;    // sketch values instead of counting them exactly
 
+// The number table is node-based and grows by one allocation per distinct
+// value, so its nodes come from an arena of the column's own: one thread
+// fills it, and it is freed in one go with the column.
+typedef unordered_map<double, size_t, std::hash<double>, std::equal_to<double>,
+                      ArenaAllocator<pair<double const, size_t>>> Numbers;
+
+// arena block size, set from the chunk size and the column count
+size_t arena_block = Arena::DEFAULT_BLOCK;
+
+// Partial aggregates of one column over the lines one thread parsed;
+// merge() folds in another thread's.  Either the exact tables or the
+// sketches are filled, depending on approx.
+//
+// Distinct values count against --max-memory.  Strings spill to disk;
+// percentiles need the numbers sorted, so a number table that goes over
+// is folded into the digest instead, and its percentiles are estimates.
 struct Column {
-    vector<csvlint::crange> strings;
-    vector<float> floats;
+    unique_ptr<Arena> arena;            // declared first: outlives numbers
+    size_t charged;                     // arena bytes charged to the budget
+    bool degraded;                      // numbers went to the digest
     size_t missing;
+    sketch::Moments moments;
+    Numbers numbers;
+    spill::Counter strings;
+    sketch::TDigest digest;
+    sketch::HyperLogLog distinct;
+    sketch::SpaceSaving top;
+
+    // many more counters than topk, so the reported values are reliable
+    Column (): arena(new Arena(arena_block)), charged(0), degraded(false), missing(0),
+        numbers(Numbers::allocator_type(arena.get())),
+        top(max<size_t>(1024, 16 * topk)) {
+    }
+
+    // empties the number table and gives its memory back
+    void drop_numbers () {
+        Numbers(Numbers::allocator_type(arena.get())).swap(numbers);
+        arena->clear();
+        spill::refund(charged);
+        charged = 0;
+    }
+
+    void degrade () {
+        for (auto const &p: numbers) {
+            digest.add(p.first, p.second);
+        }
+        drop_numbers();
+        degraded = true;
+    }
+
+    // Charges what the arena grew by, degrading if over budget.  Like a
+    // counter below the spill floor, a table below it is not degraded;
+    // arena blocks are no larger than the floor, so one block never is.
+    void account () {
+        size_t bytes = arena->bytes();
+        if (bytes == charged) return;
+        size_t n = bytes - charged;
+        charged = bytes;
+        if (spill::charge(n) && charged > spill::floor()) {
+            degrade();
+        }
+    }
+
+    void add_number (double v) {
+        moments.add(v);
+        if (approx || degraded) {
+            digest.add(v);
+        }
+        else {
+            ++numbers[v];
+            account();
+        }
+    }
+
+    void add_string (csvlint::crange e) {
+        if (approx) {
+            uint64_t h = sketch::hash_bytes(e.begin(), e.size());
+            distinct.add(h);
+            top.add(e.begin(), e.size(), h);
+        }
+        else {
+            strings.add(e.begin(), e.size());
+        }
+    }
+
+    void merge (Column &o) {
+        missing += o.missing;
+        moments.merge(o.moments);
+        if (approx) {
+            digest.merge(o.digest);
+            distinct.merge(o.distinct);
+            top.merge(o.top);
+            return;
+        }
+        if (degraded || o.degraded) {
+            if (!degraded) degrade();
+            if (!o.degraded) o.degrade();
+            digest.merge(o.digest);
+        }
+        else {
+            // the table goes with its arena
+            if (numbers.size() < o.numbers.size()) {
+                numbers.swap(o.numbers);
+                arena.swap(o.arena);
+                swap(charged, o.charged);
+            }
+            for (auto const &p: o.numbers) {
+                numbers[p.first] += p.second;
+            }
+            account();
+        }
+        // free o's table now, not with o, to keep the peak down
+        o.drop_numbers();
+        strings.merge(o.strings);
+    }
 };
 
 struct Chunk {
-    vector<string> lines;
     vector<csvlint::crange> cols;
-    vector<Column> data;
     size_t total;
+    size_t good;
 };
 
 size_t total (vector<Chunk> const &chunks) {
@@ -50,108 +159,139 @@ size_t total (vector<Chunk> const &chunks) {
 size_t good (vector<Chunk> const &chunks) {
     size_t v = 0;
     for (auto const &ch: chunks) {
-        v += ch.data.size();
+        v += ch.good;
     }
     return v;
 }
 
-// percentiles must be previously sorted
-void percentiles (vector<float> &all, vector<float> &ps) {
+// Values of the counted numbers at ranks round(ps * n), n being the
+// total count.
+void percentiles (Numbers const &numbers, size_t n, vector<double> &ps) {
+    if (n == 0) {
+        fill(ps.begin(), ps.end(), numeric_limits<double>::quiet_NaN());
+        return;
+    }
+    vector<pair<double, size_t>> all(numbers.begin(), numbers.end());
+    sort(all.begin(), all.end());
     vector<size_t> offs(ps.size());
     for (unsigned i = 0; i < offs.size(); ++i) {
-        offs[i] = round(ps[i] * all.size());
-        if (offs[i] >= all.size()) {
-            offs[i] = all.size() - 1;
+        offs[i] = round(ps[i] * n);
+        if (offs[i] >= n) {
+            offs[i] = n - 1;
         }
         if (i) {
             BOOST_VERIFY(offs[i] > offs[i-1]);
         }
     }
-    size_t last = 0;
+    size_t below = 0;   // count of values before it
+    auto it = all.begin();
     for (unsigned i = 0; i < offs.size(); ++i) {
-        nth_element(all.begin() + last, all.begin() + offs[i], all.end());
-        ps[i] = all[offs[i]];
-        last = offs[i];
+        while (below + it->second <= offs[i]) {
+            below += it->second;
+            ++it;
+        }
+        ps[i] = it->first;
     }
 }
 
-void stat_number (csvlint::Field const &f,  vector<Chunk> const &chunks, string *out) {
-    vector<float> all(good(chunks));
-    unsigned col = f.column;
-    unsigned off = 0;
-    size_t missing = 0;
-    Acc acc;
-    for (auto const &ch: chunks) {
-        for (float e: ch.data[col].floats) {
-            all[off++] = e;
-            acc(e);
+void stat_number (csvlint::Field const &f, Column &c, string *out) {
+    vector<double> ps{0, 0.25, 0.5, 0.75, 1.0};
+    if (c.degraded) {
+        LOG(warning) << f.name << ": too many distinct numbers for --max-memory, percentiles are estimates.";
+    }
+    if (approx || c.degraded) {
+        for (auto &p: ps) {
+            p = c.digest.quantile(p);
         }
-        missing += ch.data[col].missing;
     }
-    all.resize(off);
-    vector<float> ps{0, 0.25, 0.5, 0.75, 1.0};
-    percentiles(all, ps);
+    else {
+        percentiles(c.numbers, c.moments.n, ps);
+    }
     ostringstream ss;
     ss << 'N' << f.column <<':' << f.name 
-        << ',' << missing
-        << ',' << all.size()
-        << ',' << ba::mean(acc)
-        << ',' << sqrt(ba::variance(acc));
+        << ',' << c.missing
+        << ',' << size_t(c.moments.n)
+        << ',' << c.moments.mean
+        << ',' << sqrt(c.moments.variance());
     for (auto v: ps) {
         ss << ',' << v;
     }
     *out = ss.str();
 }
 
-void stat_string (csvlint::Field const &f, vector<Chunk> const &chunks, string *out, char C='S') {
-    unordered_map<string, size_t> cnts;
-    unsigned col = f.column;
-    size_t missing = 0;
-    for (auto const &ch: chunks) {
-        for (auto e: ch.data[col].strings) {
-            ++cnts[string(e.begin(), e.end())];
-        }
-        missing += ch.data[col].missing;
-    }
-    vector<pair<size_t,string>> sz(cnts.size());
-    {
-        size_t o = 0;
-        for (auto const &p: cnts) {
-            sz[o].first = p.second;
-            sz[o].second = p.first;
-            ++o;
+void stat_string_approx (csvlint::Field const &f, Column const &c, string *out, char C) {
+    // while nothing was evicted the counters hold every value exactly
+    size_t values = c.top.exact() ? c.top.size() : size_t(round(c.distinct.estimate()));
+    auto sz = c.top.top(topk);
+    ostringstream ss;
+    ss << C << f.column << ':' << f.name << ",NA:" << c.missing << ",VALUES:" << values;
+    // print the guaranteed count; an overestimated one is followed by
+    // its error bound, e.g. 60+11657
+    for (auto const &e: sz) {
+        ss << ",'" << e.value << "':" << e.count - e.error;
+        if (e.error) ss << '+' << e.error;
+    }
+    if (values > sz.size()) {
+        ss << ",...";
+    }
+    *out = ss.str();
+}
+
+void stat_string (csvlint::Field const &f, Column &c, string *out, char C='S') {
+    if (approx) {
+        stat_string_approx(f, c, out, C);
+        return;
+    }
+    // the topk largest (count, value), smallest on top
+    typedef pair<size_t, string> Entry;
+    priority_queue<Entry, vector<Entry>, greater<Entry>> best;
+    size_t values = 0;
+    c.strings.visit([&](char const *v, size_t len, size_t n) {
+        ++values;
+        if (best.size() < topk) {
+            best.push(Entry(n, string(v, len)));
+            return;
         }
+        if (topk == 0 || n < best.top().first) return;
+        if (n == best.top().first && best.top().second.compare(0, string::npos, v, len) >= 0) return;
+        best.pop();
+        best.push(Entry(n, string(v, len)));
+    });
+    vector<Entry> sz;
+    while (best.size()) {
+        sz.push_back(best.top());
+        best.pop();
     }
-    sort(sz.begin(), sz.end());
     reverse(sz.begin(), sz.end());
     ostringstream ss;
-    ss << C << f.column << ':' << f.name << ",NA:" << missing << ",VALUES:" << sz.size();
-    if (sz.size() > topk) sz.resize(topk);
+    ss << C << f.column << ':' << f.name << ",NA:" << c.missing << ",VALUES:" << values;
     for (auto const &e: sz) {
         ss << ",'" << e.second << "':" << e.first;
     }
-    if (cnts.size() > sz.size()) {
+    if (values > sz.size()) {
         ss << ",...";
     }
     *out = ss.str();
 }
 
-void stat_column (csvlint::Field const &f, vector<Chunk> const &chunks, string *out) {
+void stat_column (csvlint::Field const &f, Column &c, string *out) {
     if (f.type == csvlint::TYPE_NUMERIC) {
         string o1, o2;
-        stat_number(f, chunks, &o1);
-        stat_string(f, chunks, &o2, 'I');
+        stat_number(f, c, &o1);
+        stat_string(f, c, &o2, 'I');
         o1.push_back('\n');
         *out = o1 + o2;
     }
     else if (f.type == csvlint::TYPE_STRING) {
-        stat_string(f, chunks, out);
+        stat_string(f, c, out);
     }
     else BOOST_VERIFY(0);
 }
 
 int main (int argc, char *argv[]) {
     unsigned guess_size;
+    size_t max_memory;
+    string tmp_dir;
     
     string input_path;
     string output_path;
@@ -161,6 +301,11 @@ int main (int argc, char *argv[]) {
     ("input,I", po::value(&input_path), "input path")
     (",M", po::value(&guess_size)->default_value(10), "")
     ("topk", po::value(&topk)->default_value(topk), "")
+    ("approx", "sketch percentiles, distinct counts and top values instead of keeping every value; top counts print as a lower bound, plus the error bound if any (60+11657)")
+    ("max-memory", po::value(&max_memory)->default_value(0), "MB of distinct values to hold before spilling strings to disk and estimating percentiles, 0 for no limit")
+    ("tmp-dir", po::value(&tmp_dir)->default_value("/tmp"), "where to spill")
+    ("no-mmap", "read with pread instead of mmap")
+    ("index", "save record offsets to <input>.rows")
     ;
     po::options_description desc("Allowed options");
     desc.add(desc_visible);
@@ -179,27 +324,42 @@ int main (int argc, char *argv[]) {
     }
 
     boost::log::add_console_log(cerr);
+    approx = vm.count("approx") > 0;
+    spill::setup(max_memory * 1024 * 1024, tmp_dir);
 
     csvlint::Format fmt;
-    fmt.train(input_path, guess_size * 1024 * 1024);
+    fmt.open(input_path, guess_size * 1024 * 1024);
 
     cerr << "Parsing text..." << endl;
-    BigText<Chunk> text(input_path, fmt.data_offset, '\n', fmt.max_line, 10 * 1024*1024);
+    size_t chunk_size = 10 * 1024*1024;
+    // every thread holds a string counter and a number table per column
+    spill::share(2 * omp_get_max_threads() * fmt.fields.size());
+    // a column's share of a chunk, within reason, and within the floor
+    arena_block = min<size_t>(max<size_t>(min<size_t>(chunk_size / max<size_t>(fmt.fields.size(), 1), spill::floor()), 4096), 1024*1024);
+    BigText<Chunk> text(input_path, fmt.data_offset, '\n', fmt.max_line, chunk_size, vm.count("no-mmap") == 0);
 
     for (auto &ch: text) {
         ch.total = 0;
-        ch.data.resize(fmt.fields.size());
-        for (auto &v: ch.data) {
-            v.missing = 0;
-        }
+        ch.good = 0;
     }
-    text.lines ([&fmt](char const *begin, char const *end, Chunk *ch, size_t i_in_block) {
+    // Each thread aggregates the lines it parses into its own columns,
+    // so memory goes with the distinct values, not the number of chunks.
+    vector<vector<Column>> parts(omp_get_max_threads());
+    for (auto &part: parts) {
+        part.resize(fmt.fields.size());
+    }
+    // lines are aggregated as they are parsed, nothing refers back to them
+    text.set_drop_behind(true);
+    RowIndex index;
+    bool indexing = vm.count("index") && text.set_index(&index);
+    text.lines ([&fmt, &parts](char const *begin, char const *end, Chunk *ch, size_t i_in_block) {
         auto &cols = ch->cols;
-        ch->lines.emplace_back(begin, end);
-        bool r = fmt.parse(csvlint::crange(std::ref(ch->lines.back())), &cols);
+        bool r = fmt.parse(csvlint::crange(begin, end), &cols);
         if (r) {
+            ++ch->good;
+            vector<Column> &part = parts[omp_get_thread_num()];
             for (unsigned i = 0; i < fmt.fields.size(); ++i) {
-                Column &data = ch->data[i];
+                Column &data = part[i];
                 auto const &field = fmt.fields[i];
                 csvlint::crange e = cols[i];
                 if (e.missing()) {
@@ -207,11 +367,12 @@ int main (int argc, char *argv[]) {
                 }
                 else {
                     if (field.type == csvlint::TYPE_NUMERIC) {
-                        float v;
-                        qi::parse(e.begin(), e.end(), qi::float_, v);
-                        data.floats.push_back(v);
+                        double v;
+                        if (number::parse(e.begin(), e.end(), &v) != number::NOT_NUMBER) {
+                            data.add_number(v);
+                        }
                     }
-                    data.strings.push_back(e);
+                    data.add_string(e);
                 }
             }
         }
@@ -219,15 +380,22 @@ int main (int argc, char *argv[]) {
     });
 
     cerr << total(text) << " total lines." << endl;
+    if (indexing && !index.save(RowIndex::sidecar(input_path))) {
+        LOG(warning) << "cannot save " << RowIndex::sidecar(input_path) << '.';
+    }
     cerr << good(text) << " good lines." << endl;
 
+    cerr << "Merging chunks..." << endl;
+    reduce(parts, fmt.fields.size());
+    vector<Column> &all = parts[0];
+
     vector<string> stats(fmt.fields.size());
 
     cerr << "Counting numbers..." << endl;
     progress_display progress(fmt.fields.size(), cerr);
 #pragma omp parallel for
     for (unsigned i = 0; i < fmt.fields.size(); ++i) {
-        stat_column(fmt.fields[i], text, &stats[i]);
+        stat_column(fmt.fields[i], all[i], &stats[i]);
 #pragma omp critical
         ++progress;
     }
@@ -237,6 +405,7 @@ int main (int argc, char *argv[]) {
         if (st.empty()) continue;
         cout << st << endl;
     }
+    spill::cleanup();
 
     return 0;
 }
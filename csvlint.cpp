@@ -1,12 +1,27 @@
 #include <map>
 #include <fstream>
+#include <cerrno>
+#include <cstring>
+#include <climits>
+#include <cstdio>
+#include <cctype>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sstream>
 #include <iostream>
 #include <stdexcept>
 #include <algorithm>
 #include <boost/lexical_cast.hpp>
+#include <boost/algorithm/string/predicate.hpp>
 #include <boost/log/trivial.hpp>
 #define LOG(x) BOOST_LOG_TRIVIAL(x)
 #include "csvlint.h"
+#include "structural.h"
+#include "stream.h"
+#include "sketch.h"
+#include "number.h"
+#include "intern.h"
 
 namespace csvlint {
     using namespace std;
@@ -30,83 +45,49 @@ namespace csvlint {
     /// crange doesn't own the underlying data
     typedef vector<crange> Lines;
 
-    // keep is to keep the separator in the previous line
-    void split (crange ref, char fs, Lines *o, bool keep = false) {
-        o->clear();
-        char const *begin = ref.begin();
-        while (begin < ref.end()) {
-            char const *end = begin;
-            while (end < ref.end() && end[0] != fs) {
-                ++end;
-            }
-            if (keep) {
-                if (end < ref.end()) {
-                    ++end;
-                }
-                o->emplace_back(begin, end);
-            }
-            else {
-                o->emplace_back(begin, end);
-                ++end;
-            }
-            begin = end;
-        }
-    }
-
     // this handles the case when fs == 0 for splitting without fs
     void split_with_quote (crange ref, char fs, char quote, vector<crange> *o, vector<crange> *cut_breakers = nullptr) {
-        if (quote == 0) {
-            split(ref, fs, o);
-            return;
-        }
         o->clear();
-        char const *begin = ref.begin();
-        while (begin < ref.end()) {
-            char const *end = begin;
-            bool breaks_cut = false;
-            if (begin[0] == quote) {
-                ++end;
-                while (end < ref.end() && end[0] != quote) {
-                    if (end[0] == fs) {
-                        breaks_cut = true;
-                    }
-                    ++end;
-                }
-                BOOST_VERIFY(end < ref.end());
-                ++end;
-            }
-            else {
-                while (end < ref.end() && end[0] != fs) {
-                    ++end;
-                }
-            }
+        structural::split(ref.begin(), ref.end(), fs, quote,
+                [o, cut_breakers](char const *begin, char const *end, bool breaks_cut) {
             o->emplace_back(begin, end);
             if (breaks_cut && cut_breakers) {
                 if (cut_breakers->size() < MAX_CUT_BREAKER_SAMPLE) {
                     cut_breakers->push_back(o->back());
                 }
             }
-            begin = end+1;
+        });
+    }
+
+    // keep is to keep the separator in the previous line
+    void split (crange ref, char fs, Lines *o, bool keep = false) {
+        if (!keep) {
+            split_with_quote(ref, fs, 0, o);
+            return;
+        }
+        o->clear();
+        char const *begin = ref.begin();
+        structural::for_each(ref.begin(), ref.end(), fs, [o, &begin](char const *sep) {
+            o->emplace_back(begin, sep + 1);
+            begin = sep + 1;
+        });
+        if (begin < ref.end()) {
+            o->emplace_back(begin, ref.end());
         }
     }
 
+    size_t SAMPLE_HEAD = 256 * 1024;
+    unsigned SAMPLE_WINDOWS = 16;
+    size_t SAMPLE_WINDOW = 16 * 1024;
+
+    // a line longer than anything sampled may still show up elsewhere
+    static size_t const MIN_MAX_LINE = 64 * 1024;
+
     class Text: public Lines {
         string buffer;
-    public:
-        Text (string const &path, size_t max) {
-            ifstream is(path.c_str());
-            BOOST_VERIFY(is);
-            is.seekg(0, ios::end);
-            size_t sz = is.tellg();
-            bool trimmed = 0;
-            if ((max > 0) && (sz > max)) {
-                sz = max;
-                trimmed = true;
-            }
-            buffer.resize(sz);
-            is.seekg(0);
-            is.read(&buffer[0], buffer.size());
-            BOOST_VERIFY(is);
+
+        // cut buffer back to its last complete line if it was truncated
+        void trim (bool trimmed) {
             char const *begin = &buffer[0];
             char const *end = begin + buffer.size();
             BOOST_VERIFY(end > begin);
@@ -123,12 +104,65 @@ namespace csvlint {
                 BOOST_VERIFY(last >= begin);
                 end = last + 1;
             }
-            split(crange(begin, end), '\n', this, true);
-            LOG(info) << size() << " lines loaded from " << path << ".";
+            buffer.resize(end - begin);
+        }
+
+        void index (string const &name) {
+            char const *begin = &buffer[0];
+            split(crange(begin, begin + buffer.size()), '\n', this, true);
+            LOG(info) << size() << " lines loaded from " << name << ".";
+        }
+    public:
+        // Loads the first max bytes (0 for all), plus the complete lines
+        // of `windows` windows of `window` bytes spread evenly over the
+        // rest of the file.
+        Text (string const &path, size_t max, unsigned windows = 0, size_t window = 0) {
+            ifstream is(path.c_str());
+            BOOST_VERIFY(is);
+            is.seekg(0, ios::end);
+            size_t total = is.tellg();
+            size_t sz = total;
+            bool trimmed = 0;
+            if ((max > 0) && (sz > max)) {
+                sz = max;
+                trimmed = true;
+            }
+            buffer.resize(sz);
+            is.seekg(0);
+            is.read(&buffer[0], buffer.size());
+            BOOST_VERIFY(is);
+            trim(trimmed);
+            if (windows && total > sz + window) {
+                string w(window + 1, 0);
+                for (unsigned i = 0; i < windows; ++i) {
+                    // read one byte early to see if we start at a line boundary
+                    size_t off = sz + (total - sz - window) * (i + 1) / windows;
+                    is.seekg(off - 1);
+                    is.read(&w[0], w.size());
+                    BOOST_VERIFY(is);
+                    size_t first = w.find('\n');
+                    size_t last = w.rfind('\n');
+                    if (first == last) continue;    // no complete line
+                    buffer.append(w, first + 1, last - first);
+                }
+            }
+            index(path);
+        }
+
+        // Loads the first max bytes peeked from a stream; eof tells
+        // whether data is all there is.
+        Text (string const &name, string const &data, size_t max, bool eof) {
+            bool trimmed = !eof || data.size() > max;
+            buffer.assign(data, 0, std::min(max, data.size()));
+            trim(trimmed);
+            index(name);
         }
         char const *origin () const {
             return &buffer[0];
         }
+        size_t loaded () const {
+            return buffer.size();
+        }
     };
 
     string unquote (crange in, char quote) {
@@ -217,11 +251,46 @@ namespace csvlint {
         return unix ? EOL_UNIX : EOL_DOS;
     }
 
-    char detect_fs (Text const &lines, unsigned *columns) {
+    // Per-line counts of every candidate separator and quote character,
+    // gathered in a single pass over the sample.  Bytes are mapped to a
+    // slot through a 256-entry table (slot 0 collects everything else),
+    // so the cost doesn't depend on how many candidates there are.
+    class Histogram {
+        unsigned char slot[256];
+        unsigned width;
+        vector<unsigned> counts;
+    public:
+        Histogram (Lines const &lines) {
+            memset(slot, 0, sizeof(slot));
+            width = 1;
+            for (vector<char> const *v: {&COMMON_FS, &COMMON_QUOTE}) {
+                for (char c: *v) {
+                    unsigned char u = c;
+                    if (slot[u] == 0 && width < 256) slot[u] = width++;
+                }
+            }
+            counts.resize(lines.size() * width);
+            unsigned *row = counts.data();
+            for (crange const &line: lines) {
+                for (char c: line) {
+                    ++row[slot[(unsigned char)c]];
+                }
+                row += width;
+            }
+        }
+        // occurrences of candidate c on line i
+        unsigned operator () (unsigned i, char c) const {
+            unsigned s = slot[(unsigned char)c];
+            BOOST_VERIFY(s);
+            return counts[i * width + s];
+        }
+    };
+
+    char detect_fs (Lines const &lines, Histogram const &hist, unsigned *columns) {
         map<pair<char, unsigned>, unsigned> candidates;
-        for (char fs: COMMON_FS) {
-            for (auto const &line: lines) {
-                unsigned n = count(line.begin(), line.end(), fs) + 1;
+        for (unsigned i = 0; i < lines.size(); ++i) {
+            for (char fs: COMMON_FS) {
+                unsigned n = hist(i, fs) + 1;
                 if (n > 1) {
                     candidates[make_pair(fs, n)] += 1;
                 }
@@ -245,10 +314,10 @@ namespace csvlint {
         return fs;
     }
 
-    unsigned detect_prelude (Text const &lines, unsigned columns, char fs) {
+    unsigned detect_prelude (Lines const &lines, Histogram const &hist, unsigned columns, char fs) {
         unsigned c = 0;
         for (unsigned i = 0; i < lines.size(); ++i) {
-            unsigned n = count(lines[i].begin(), lines[i].end(), fs) + 1;
+            unsigned n = hist(i, fs) + 1;
             if (n != columns) {
                 ++c;
             }
@@ -260,28 +329,35 @@ namespace csvlint {
         return c;
     }
 
-    int detect_quote (Text const &lines, unsigned prelude, unsigned columns, char fs) {
+    // A quote candidate counts when it both opens and closes a field.
+    // Only lines the histogram shows to contain a candidate at least
+    // twice are looked at, and fields are walked in place.
+    int detect_quote (Lines const &lines, Histogram const &hist, char fs) {
         std::unordered_map<char, unsigned> cnt;
         unsigned total = 0;
-        for (crange const &line: lines) {
+        for (unsigned i = 0; i < lines.size(); ++i) {
             if (total >= 10000) break;
-            vector<crange> v;
-            split(line, fs, &v);
-            for (auto f: v) {
-                if (f.begin() + 1 < f.end()) {
-                    if (f.begin()[0] == (f.end()-1)[0]) {
-                        if (!isalnum(f.begin()[0])) {
-                            ++total;
-                            ++cnt[f.begin()[0]];
-                        }
+            crange const &line = lines[i];
+            for (char q: COMMON_QUOTE) {
+                if (q == fs || hist(i, q) < 2) continue;
+                auto wrapped = [&](char const *b, char const *e) {
+                    if (b + 1 < e && b[0] == q && e[-1] == q) {
+                        ++total;
+                        ++cnt[q];
                     }
-                }
+                };
+                char const *field = line.begin();
+                structural::for_each(line.begin(), line.end(), fs, [&](char const *sep) {
+                    wrapped(field, sep);
+                    field = sep + 1;
+                });
+                wrapped(field, line.end());
             }
         }
         if (cnt.size() > 1) {
             cerr << "Multiple quotes detected:";
             for (auto p: cnt) {
-                cerr << ' ' << '\'' << p.second << '\'' << ':' << p.first;
+                cerr << ' ' << '\'' << p.first << '\'' << ':' << p.second;
             }
             cerr << endl;
             throw runtime_error("Multiple quotes detected.");
@@ -305,22 +381,152 @@ namespace csvlint {
 #endif
 
     bool is_numeric (crange const &s) {
-        int num = 0;
-        int dot = 0;
-        char const *p = s.begin();
-        if (p >= s.end()) return false;
-        if (*p == '-') ++p;
-        for (; p != s.end(); ++p) {
-            if ((*p >= '0') && (*p <= '9')) {
-                ++num;
+        double v;
+        return number::parse(s.begin(), s.end(), &v) != number::NOT_NUMBER;
+    }
+
+    char const *kind_name (int kind) {
+        static char const *NAMES[] = {"string", "categorical", "bool", "int32", "int64",
+                                      "float64", "date", "timestamp"};
+        BOOST_VERIFY(kind >= 0 && kind < KIND_COUNT);
+        return NAMES[kind];
+    }
+
+    // most distinct values of a categorical field, so codes fit in a byte
+    static unsigned const MAX_CATEGORIES = 256;
+
+    // Date and timestamp layouts tried by training: fixed-width %Y, %m,
+    // %d, %H, %M, %S and literal characters.
+    static char const *TIME_PATTERNS[] = {
+        "%Y-%m-%d", "%Y/%m/%d", "%m/%d/%Y", "%d/%m/%Y", "%d.%m.%Y",
+        "%Y-%m-%d %H:%M:%S", "%Y-%m-%dT%H:%M:%S", "%Y-%m-%dT%H:%M:%SZ", "%Y/%m/%d %H:%M:%S"
+    };
+    static unsigned const TIME_PATTERN_COUNT = sizeof(TIME_PATTERNS) / sizeof(TIME_PATTERNS[0]);
+
+    // days from 1970-01-01 to y-m-d in the proleptic Gregorian calendar
+    static int64_t days_from_civil (int64_t y, unsigned m, unsigned d) {
+        y -= m <= 2;
+        int64_t era = (y >= 0 ? y : y - 399) / 400;
+        unsigned yoe = unsigned(y - era * 400);
+        unsigned doy = (153 * (m > 2 ? m - 3 : m + 9) + 2) / 5 + d - 1;
+        unsigned doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+        return era * 146097 + int64_t(doe) - 719468;
+    }
+
+    // Seconds since the epoch of [b, e) laid out as pattern; false if it
+    // does not match or is not a valid date.
+    static bool match_time (char const *b, char const *e, char const *pattern, int64_t *seconds) {
+        static unsigned const MDAYS[] = {31, 29, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31};
+        unsigned v[6] = {0, 1, 1, 0, 0, 0};     // Y m d H M S
+        char const *p = b;
+        for (char const *f = pattern; *f; ++f) {
+            if (*f != '%') {
+                if (p >= e || *p != *f) return false;
+                ++p;
+                continue;
+            }
+            ++f;
+            unsigned slot, width;
+            switch (*f) {
+                case 'Y': slot = 0; width = 4; break;
+                case 'm': slot = 1; width = 2; break;
+                case 'd': slot = 2; width = 2; break;
+                case 'H': slot = 3; width = 2; break;
+                case 'M': slot = 4; width = 2; break;
+                case 'S': slot = 5; width = 2; break;
+                default: BOOST_VERIFY(0);
             }
-            else if (*p == '.') {
-                ++dot;
+            if (unsigned(e - p) < width) return false;
+            unsigned x = 0;
+            for (unsigned i = 0; i < width; ++i, ++p) {
+                if (unsigned(*p - '0') >= 10) return false;
+                x = x * 10 + (*p - '0');
             }
-            else return false;
+            v[slot] = x;
+        }
+        if (p != e) return false;
+        if (v[1] < 1 || v[1] > 12 || v[2] < 1 || v[2] > MDAYS[v[1] - 1]) return false;
+        if (v[1] == 2 && v[2] == 29 && (v[0] % 4 || (v[0] % 100 == 0 && v[0] % 400))) return false;
+        if (v[3] > 23 || v[4] > 59 || v[5] > 60) return false;
+        *seconds = days_from_civil(v[0], v[1], v[2]) * 86400 + v[3] * 3600 + v[4] * 60 + v[5];
+        return true;
+    }
+
+    static bool is_bool (crange s, bool *v) {
+        if (boost::iequals(s, "true")) *v = true;
+        else if (boost::iequals(s, "false")) *v = false;
+        else return false;
+        return true;
+    }
+
+    static bool parse_bool (crange s, Field const &, Value *v) {
+        bool b;
+        if (!is_bool(s, &b)) return false;
+        v->i = b;
+        return true;
+    }
+
+    static bool parse_integer (crange s, Field const &f, Value *v) {
+        double d;
+        int64_t i;
+        if (number::parse(s.begin(), s.end(), &d, &i) != number::INTEGER) return false;
+        if (f.kind == KIND_INT32 && (i < INT32_MIN || i > INT32_MAX)) return false;
+        v->i = i;
+        return true;
+    }
 
+    static bool parse_float64 (crange s, Field const &, Value *v) {
+        if (number::parse(s.begin(), s.end(), &v->d) != number::NOT_NUMBER) return true;
+        // exponents, inf and the like
+        if (s.empty() || isspace(s.front())) return false;
+        string buf(s.begin(), s.end());
+        char *end;
+        v->d = strtod(buf.c_str(), &end);
+        return end == buf.c_str() + buf.size();
+    }
+
+    static bool parse_date (crange s, Field const &f, Value *v) {
+        int64_t t;
+        if (!match_time(s.begin(), s.end(), f.pattern.c_str(), &t)) return false;
+        v->i = t / 86400;
+        return true;
+    }
+
+    static bool parse_timestamp (crange s, Field const &f, Value *v) {
+        return match_time(s.begin(), s.end(), f.pattern.c_str(), &v->i);
+    }
+
+    Kernel kernel (int kind) {
+        static Kernel const KERNELS[] = {nullptr, nullptr, parse_bool, parse_integer, parse_integer,
+                                         parse_float64, parse_date, parse_timestamp};
+        BOOST_VERIFY(kind >= 0 && kind < KIND_COUNT);
+        return KERNELS[kind];
+    }
+
+    int widen (int kind) {
+        switch (kind) {
+            case KIND_INT32: return KIND_INT64;
+            case KIND_INT64: return KIND_FLOAT64;
+            default: return KIND_STRING;
+        }
+    }
+
+    // Bit i of the result is set if s matches TIME_PATTERNS[i]; bit
+    // TIME_PATTERN_COUNT if it is a bool.  ANDing over a column leaves
+    // the layouts every value fits.
+    static uint32_t classify (crange s) {
+        static_assert(TIME_PATTERN_COUNT < 32, "too many time patterns");
+        uint32_t mask = 0;
+        bool b;
+        if (is_bool(s, &b)) mask |= uint32_t(1) << TIME_PATTERN_COUNT;
+        // cheap reject: every layout starts with a digit
+        if (s.size() && unsigned(s.front() - '0') < 10) {
+            int64_t t;
+            for (unsigned i = 0; i < TIME_PATTERN_COUNT; ++i) {
+                if (match_time(s.begin(), s.end(), TIME_PATTERNS[i], &t)) mask |= uint32_t(1) << i;
+            }
         }
-        return (num > 0) && (dot <= 1);
+        return mask;
     }
 
 
@@ -331,23 +537,48 @@ namespace csvlint {
         // test numeric value
         do {
             vector<crange> bad;
+            vector<double> values;
             unsigned total = 0;
+            int kind = KIND_INT32;      // narrowest kind holding every value
             for (crange const &s: v) {
-                if (!is_numeric(s)) {
+                double x;
+                int64_t i;
+                int r = number::parse(s.begin(), s.end(), &x, &i);
+                if (r == number::DECIMAL || r == number::BIG_INTEGER) {
+                    kind = KIND_FLOAT64;
+                }
+                else if (r == number::INTEGER && (i < INT32_MIN || i > INT32_MAX)) {
+                    kind = std::max<int>(kind, KIND_INT64);
+                }
+                if (r == number::NOT_NUMBER) {
                     bad.push_back(s);
                     //if (bad.size() >= v.size() * 3 / 4) goto not_numeric;
                     if (bad.front() != bad.back()) goto not_numeric;    // different missing values
                 }
                 else {
+                    values.push_back(x);
                     ++total;
                 }
             }
             if (total == 0) goto not_numeric;
             // we are sure this column is numeric
             field->type = TYPE_NUMERIC;
+            field->kind = kind;
+            field->pattern.clear();
             if (bad.size() > 0) {
                 ext->na = string(bad[0].begin(), bad[0].end());
             }
+            {   // sample percentiles
+                sketch::TDigest digest;
+                for (double x: values) {
+                    digest.add(x);
+                }
+                ext->p5 = digest.quantile(0.05);
+                ext->p25 = digest.quantile(0.25);
+                ext->p50 = digest.quantile(0.5);
+                ext->p75 = digest.quantile(0.75);
+                ext->p95 = digest.quantile(0.95);
+            }
             return;
         } while (false);
 not_numeric:
@@ -356,32 +587,60 @@ not_numeric:
         ext->na.clear();
         if (quote_char) { // missing detection is only viable if we have quote
                          // otherwise no way to distinguish between empty string and missing values
-            unordered_map<string, int> cnts;
+            InternTable<int> cnts;
             for (crange const &s: v) {
                 if (s.empty() || s.front() != quote_char) {
-                    ++cnts[string(s.begin(), s.end())];
+                    ++cnts.insert(s.begin(), s.size()).first->value;
                 }
             }
             field->quoted = true;
             if (cnts.size() > 1) {
                 cerr << "Multiple missing values detected:";
-                for (auto const &p: cnts) {
-                    cerr << ' ' << p.first << ':' << p.second;
-                }
+                cnts.for_each([](InternTable<int>::Slot const &p) {
+                    cerr << ' ' << p.key() << ':' << p.value;
+                });
                 cerr << endl;
                 throw runtime_error("Multiple missing values detected.");
             }
-            if (cnts.size()) {
-                ext->na = cnts.begin()->first;
-                ext->missing = cnts.begin()->second;
-            }
+            cnts.for_each([ext](InternTable<int>::Slot const &p) {
+                ext->na = p.key();
+                ext->missing = p.value;
+            });
         }
         field->type = TYPE_STRING;
+        field->kind = KIND_STRING;
+        field->pattern.clear();
+        {   // narrow down by the values, leaving out missing ones
+            uint32_t mask = ~uint32_t(0);
+            InternTable<unsigned> distinct;
+            size_t n = 0;
+            for (crange s: v) {
+                if (field->quoted) {
+                    if (!is_quoted(s, quote_char)) continue;
+                    s = crange(s.begin() + 1, s.end() - 1);
+                }
+                mask &= classify(s);
+                if (distinct.size() <= MAX_CATEGORIES) {
+                    distinct.insert(s.begin(), s.size());
+                }
+                ++n;
+            }
+            if (n == 0) return;
+            if (mask >> TIME_PATTERN_COUNT & 1) {
+                field->kind = KIND_BOOL;
+            }
+            else if (mask) {
+                char const *pattern = TIME_PATTERNS[__builtin_ctz(mask)];
+                field->kind = strchr(pattern, 'H') ? KIND_TIMESTAMP : KIND_DATE;
+                field->pattern = pattern;
+            }
+            else if (distinct.size() <= MAX_CATEGORIES && distinct.size() * 4 <= n) {
+                field->kind = KIND_CATEGORICAL;
+            }
+        }
     }
 
-    void Format::train (string const &path, size_t max_buffer) {
-        Text lines(path, max_buffer);
-
+    void Format::train (Text &lines) {
         eol_type = detect_and_trim_eol(&lines);
         if (eol_type == EOL_UNIX) {
             eol_str = "\n";
@@ -391,15 +650,19 @@ not_numeric:
         }
 
         unsigned columns;
-        fs_char = detect_fs(lines, &columns);
+        Histogram hist(lines);
+        fs_char = detect_fs(lines, hist, &columns);
         // test delims
         // determine prelude
-        prelude = detect_prelude(lines, columns, fs_char);
+        prelude = detect_prelude(lines, hist, columns, fs_char);
         unsigned first = prelude;
         if (first + 1 < lines.size()) ++first;  // skip potential title row
-        quote_char = detect_quote(lines, first, columns, fs_char);
+        quote_char = detect_quote(lines, hist, fs_char);
 
         vector<vector<crange>> matrix(columns);
+        // nothing from an earlier round or a stale cache carries over
+        na_str.clear();
+        fields.clear();
         fields.resize(columns);
         vector<FieldExt> fields_ext(columns);
         max_line = 0;
@@ -524,6 +787,252 @@ not_numeric:
         data_offset = lines[start].begin() - lines.origin();
     }
 
+    // whether two training rounds came to the same conclusions
+    static bool same_decisions (Format const &a, Format const &b) {
+        if (a.eol_type != b.eol_type
+                || a.fs_char != b.fs_char
+                || a.quote_char != b.quote_char
+                || a.na_str != b.na_str
+                || a.has_header != b.has_header
+                || a.prelude != b.prelude
+                || a.fields.size() != b.fields.size()) return false;
+        for (unsigned i = 0; i < a.fields.size(); ++i) {
+            if (a.fields[i].type != b.fields[i].type
+                    || a.fields[i].quoted != b.fields[i].quoted
+                    || a.fields[i].kind != b.fields[i].kind
+                    || a.fields[i].pattern != b.fields[i].pattern) return false;
+        }
+        return true;
+    }
+
+    void Format::train (string const &path, size_t max_buffer) {
+        fs_tried.assign(COMMON_FS.begin(), COMMON_FS.end());
+        quote_tried.assign(COMMON_QUOTE.begin(), COMMON_QUOTE.end());
+        if (stream::Source *src = stream::get(path)) {
+            // no size and no seeking: grow a peeked head until stable
+            Format last;
+            size_t head = SAMPLE_HEAD;
+            for (unsigned round = 0;; ++round) {
+                bool all = max_buffer > 0 && head >= max_buffer;
+                if (all) head = max_buffer;
+                string const &data = src->peek(head);
+                bool eof = data.size() < head;
+                Text lines(path, data, head, eof);
+                LOG(info) << "sampling round " << round << ": " << lines.loaded() << " bytes.";
+                train(lines);
+                if (all || eof) break;
+                if (round > 0 && same_decisions(*this, last)) {
+                    max_line = std::max(std::max(max_line, last.max_line) * 2, MIN_MAX_LINE);
+                    break;
+                }
+                last = *this;
+                head *= 2;
+            }
+            sample = max_buffer;
+            source.clear();
+            return;
+        }
+        struct stat st;
+        if (stat(path.c_str(), &st) != 0) {
+            throw runtime_error("cannot stat " + path + ".");
+        }
+        size_t total = st.st_size;
+        size_t budget = (max_buffer == 0 || max_buffer > total) ? total : max_buffer;
+        size_t head = SAMPLE_HEAD;
+        unsigned windows = SAMPLE_WINDOWS;
+        Format last;
+        for (unsigned round = 0;; ++round) {
+            bool all = head + windows * SAMPLE_WINDOW >= budget;
+            Text lines(path, all ? max_buffer : head, all ? 0 : windows, SAMPLE_WINDOW);
+            LOG(info) << "sampling round " << round << ": " << lines.loaded() << " bytes.";
+            train(lines);
+            if (all) break;
+            if (round > 0 && same_decisions(*this, last)) {
+                max_line = std::max(std::max(max_line, last.max_line) * 2, MIN_MAX_LINE);
+                break;
+            }
+            last = *this;
+            head *= 2;
+            windows *= 2;
+        }
+        sample = budget;
+        source.clear();
+    }
+
+    // Format cache.  The file is line oriented text; strings are stored
+    // as <length>:<bytes> so any separator, quote or N/A survives.
+    static char const *CACHE_SUFFIX = ".csvlint";
+    static char const *CACHE_MAGIC = "csvlint-format";
+    static unsigned const CACHE_VERSION = 3;
+    static size_t const CACHE_HEAD = 64 * 1024;   // bytes hashed into the key
+
+    // Identifies the content of a regular file without reading it all:
+    // size, mtime and a FNV-1a hash of the first CACHE_HEAD bytes.
+    // Returns false for anything we can't key reliably (pipes etc.).
+    static bool fingerprint (string const &path, string *key, size_t *size) {
+        struct stat st;
+        if (stat(path.c_str(), &st) != 0 || !S_ISREG(st.st_mode)) return false;
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) return false;
+        vector<char> head(std::min<size_t>(st.st_size, CACHE_HEAD));
+        ssize_t r = head.empty() ? 0 : pread(fd, &head[0], head.size(), 0);
+        close(fd);
+        if (r != ssize_t(head.size())) return false;
+        uint64_t h = 14695981039346656037ULL;
+        for (char c: head) {
+            h = (h ^ uint8_t(c)) * 1099511628211ULL;
+        }
+        ostringstream ss;
+        ss << st.st_size << ' ' << st.st_mtim.tv_sec << '.' << st.st_mtim.tv_nsec << ' ' << hex << h;
+        *key = ss.str();
+        *size = st.st_size;
+        return true;
+    }
+
+    static void save_string (ostream &os, string const &s) {
+        os << s.size() << ':' << s;
+    }
+
+    static string load_string (istream &is) {
+        size_t n;
+        is >> n;
+        if (!is || is.get() != ':') throw runtime_error("bad string in format file.");
+        string s(n, 0);
+        if (n) is.read(&s[0], n);
+        if (!is) throw runtime_error("bad string in format file.");
+        return s;
+    }
+
+    static void expect (istream &is, char const *key) {
+        string s;
+        is >> s;
+        if (!is || s != key) throw runtime_error(string("bad format file, expecting ") + key + ".");
+    }
+
+    void Format::load (string const &path) {
+        ifstream is(path.c_str(), ios::binary);
+        if (!is) throw runtime_error("cannot open " + path + ".");
+        unsigned version;
+        expect(is, CACHE_MAGIC);
+        is >> version;
+        if (!is || version != CACHE_VERSION) throw runtime_error("unsupported format file version.");
+        int fs, quote;
+        expect(is, "source"); source = load_string(is);
+        expect(is, "sample"); is >> sample;
+        expect(is, "tried"); fs_tried = load_string(is); quote_tried = load_string(is);
+        expect(is, "eol"); is >> eol_type;
+        expect(is, "fs"); is >> fs;
+        expect(is, "quote"); is >> quote;
+        expect(is, "na"); na_str = load_string(is);
+        expect(is, "header"); is >> has_header >> header_quoted;
+        expect(is, "prelude"); is >> prelude;
+        expect(is, "data_offset"); is >> data_offset;
+        expect(is, "max_line"); is >> max_line;
+        size_t n;
+        expect(is, "fields"); is >> n;
+        if (!is) throw runtime_error("bad format file " + path + ".");
+        fs_char = fs;
+        quote_char = quote;
+        eol_str = (eol_type == EOL_DOS) ? "\r\n" : "\n";
+        fields.resize(n);
+        for (auto &f: fields) {
+            is >> f.column >> f.type >> f.quoted >> f.kind;
+            f.name = load_string(is);
+            f.pattern = load_string(is);
+            if (f.type != TYPE_NUMERIC && f.type != TYPE_STRING) {
+                throw runtime_error("bad field type in format file.");
+            }
+            if (f.kind < 0 || f.kind >= KIND_COUNT) {
+                throw runtime_error("bad field kind in format file.");
+            }
+        }
+        if (!is) throw runtime_error("bad format file " + path + ".");
+    }
+
+    void Format::save (string const &path) const {
+        // write aside and rename, so a concurrent reader never sees
+        // a partial file
+        string tmp = path + ".tmp" + lexical_cast<string>(getpid());
+        {
+            ofstream os(tmp.c_str(), ios::binary);
+            if (!os) throw runtime_error("cannot create " + tmp + ".");
+            os << CACHE_MAGIC << ' ' << CACHE_VERSION << '\n';
+            os << "source "; save_string(os, source); os << '\n';
+            os << "sample " << sample << '\n';
+            os << "tried "; save_string(os, fs_tried); os << ' '; save_string(os, quote_tried); os << '\n';
+            os << "eol " << eol_type << '\n';
+            os << "fs " << int(fs_char) << '\n';
+            os << "quote " << int(quote_char) << '\n';
+            os << "na "; save_string(os, na_str); os << '\n';
+            os << "header " << has_header << ' ' << header_quoted << '\n';
+            os << "prelude " << prelude << '\n';
+            os << "data_offset " << data_offset << '\n';
+            os << "max_line " << max_line << '\n';
+            os << "fields " << fields.size() << '\n';
+            for (auto const &f: fields) {
+                os << f.column << ' ' << f.type << ' ' << f.quoted << ' ' << f.kind << ' ';
+                save_string(os, f.name);
+                os << ' ';
+                save_string(os, f.pattern);
+                os << '\n';
+            }
+            os.flush();
+            if (!os) {
+                unlink(tmp.c_str());
+                throw runtime_error("failed writing " + tmp + ".");
+            }
+        }
+        if (rename(tmp.c_str(), path.c_str()) != 0) {
+            unlink(tmp.c_str());
+            throw runtime_error("cannot rename " + tmp + " to " + path + ".");
+        }
+    }
+
+    // whether every candidate in want was tried
+    static bool covers (string const &tried, vector<char> const &want) {
+        for (char c: want) {
+            if (tried.find(c) == string::npos) return false;
+        }
+        return true;
+    }
+
+    void Format::open (string const &path, size_t max_buffer) {
+        string key;
+        size_t size;
+        if (!fingerprint(path, &key, &size)) {
+            train(path, max_buffer);
+            return;
+        }
+        string cache = path + CACHE_SUFFIX;
+        size_t wanted = (max_buffer == 0 || max_buffer > size) ? size : max_buffer;
+        try {
+            // loaded aside, so a stale or half-read cache leaves no trace
+            Format cached;
+            cached.load(cache);
+            // extra candidates given to probe carry over to the other
+            // tools, which don't take them
+            if (cached.source == key && cached.sample >= wanted
+                    && covers(cached.fs_tried, COMMON_FS)
+                    && covers(cached.quote_tried, COMMON_QUOTE)) {
+                *this = cached;
+                LOG(info) << "format loaded from " << cache << ".";
+                return;
+            }
+            LOG(info) << cache << " is stale, retraining.";
+        }
+        catch (runtime_error const &e) {
+            LOG(info) << "no usable format cache: " << e.what();
+        }
+        train(path, max_buffer);
+        source = key;
+        try {
+            save(cache);
+        }
+        catch (runtime_error const &e) {
+            LOG(warning) << "format not cached: " << e.what();
+        }
+    }
+
     void Format::summary (ostream &os, bool details) const {
         for (unsigned i = 0; i < fields.size(); ++i) {
             os << "COL:" << i;
@@ -535,6 +1044,10 @@ not_numeric:
                 case TYPE_STRING: os << "string"; break;
                 default: BOOST_VERIFY(0);
             }
+            os << " KIND:" << kind_name(field.kind);
+            if (field.pattern.size()) {
+                os << '(' << field.pattern << ')';
+            }
             os << endl;
         }
     }
@@ -563,6 +1076,10 @@ not_numeric:
                     if (back[0] != '\r') return false;
                     end = back;
                 }
+                else if (back[0] == '\r') {
+                    // '\n' already removed, e.g. by getline
+                    end = back;
+                }
             }
         }
         // separate to field
@@ -585,45 +1102,100 @@ not_numeric:
         return true;
     }
 
-    void Format::write_header (ostream &os) const {
+    void write_fully (int fd, char const *buf, size_t sz) {
+        while (sz) {
+            ssize_t r = ::write(fd, buf, sz);
+            if (r < 0) {
+                if (errno == EINTR) continue;
+                cerr << "write(" << fd << "): " << strerror(errno) << endl;
+                BOOST_VERIFY(0);
+            }
+            buf += r;
+            sz -= r;
+        }
+    }
+
+    void writev_fully (int fd, vector<iovec> *spans) {
+        if (spans->empty()) return;
+        iovec *v = &spans->at(0);
+        iovec *end = v + spans->size();
+        while (v < end) {
+            int n = std::min<ptrdiff_t>(end - v, IOV_MAX);
+            ssize_t r = ::writev(fd, v, n);
+            if (r < 0) {
+                if (errno == EINTR) continue;
+                cerr << "writev(" << fd << "): " << strerror(errno) << endl;
+                BOOST_VERIFY(0);
+            }
+            while (v < end && size_t(r) >= v->iov_len) {
+                r -= v->iov_len;
+                ++v;
+            }
+            if (r > 0) {
+                v->iov_base = reinterpret_cast<char *>(v->iov_base) + r;
+                v->iov_len -= r;
+            }
+        }
+        spans->clear();
+    }
+
+    void Format::write_header (Writer &w) const {
         bool first = true;
         for (auto const &f: fields) {
             if (first) {
                 first = false;
             }
             else {
-                os << fs_char;
+                w.put(fs_char);
             }
             if (header_quoted) {
-                os << quote_char << f.name << quote_char;
+                w.put(quote_char);
+                w.write(f.name);
+                w.put(quote_char);
             }
             else {
-                os << f.name;
+                w.write(f.name);
             }
         }
-        os << eol_str;
+        w.write(eol_str);
     }
 
-    void Format::write_line (ostream &os, vector<crange> const &in) const {
+    void Format::write_line (Writer &w, vector<crange> const &in) const {
         bool first = true;
         for (auto const &f: fields) {
             if (first) {
                 first = false;
             }
             else {
-                os << fs_char;
+                w.put(fs_char);
             }
-            if (in[f.column].missing()) {
-                os << na_str;
+            crange const &e = in[f.column];
+            if (e.missing()) {
+                w.write(na_str);
             }
             else if (f.quoted) {
-                os << quote_char << in[f.column] << quote_char;
+                w.put(quote_char);
+                w.write(e);
+                w.put(quote_char);
             }
             else {
-                os << in[f.column];
+                w.write(e);
             }
         }
-        os << eol_str;
+        w.write(eol_str);
     }
-}
 
+    // The ostream versions format into a buffer sized by the line, not
+    // Writer's default capacity, which would be reserved on every call.
+    void Format::write_header (ostream &os) const {
+        Writer w(-1, 0);
+        write_header(w);
+        os.write(w.buffer().data(), w.buffer().size());
+    }
+
+    void Format::write_line (ostream &os, vector<crange> const &in) const {
+        Writer w(-1, 0);
+        write_line(w, in);
+        os.write(w.buffer().data(), w.buffer().size());
+    }
+}
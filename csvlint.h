@@ -1,7 +1,12 @@
+#ifndef AAALGO_CSVLINT
+#define AAALGO_CSVLINT
+
+#include <stdint.h>
 #include <string>
 #include <vector>
 #include <iostream>
 #include <unordered_map>
+#include <sys/uio.h>
 #include <boost/range/iterator_range_core.hpp>
 
 namespace csvlint {
@@ -14,11 +19,33 @@ namespace csvlint {
     extern vector<char> COMMON_QUOTE;
     extern vector<string> COMMON_NA;    // has to be converted to uppercase before comparison
 
+    // Training sample: the head of the file plus windows spread over the
+    // rest.  Both grow until two successive rounds agree or -M is reached.
+    extern size_t SAMPLE_HEAD;
+    extern unsigned SAMPLE_WINDOWS;
+    extern size_t SAMPLE_WINDOW;
+
+    class Text;
+
     enum {
         TYPE_NUMERIC = 0,
         TYPE_STRING = 1
     };
 
+    // Finer type inferred by training.  TYPE_NUMERIC fields are one of the
+    // integer kinds or KIND_FLOAT64, TYPE_STRING fields any other kind.
+    enum {
+        KIND_STRING = 0,
+        KIND_CATEGORICAL = 1,    // few distinct values, each repeated
+        KIND_BOOL = 2,           // true / false in any case
+        KIND_INT32 = 3,
+        KIND_INT64 = 4,
+        KIND_FLOAT64 = 5,
+        KIND_DATE = 6,           // Field::pattern, e.g. %Y-%m-%d
+        KIND_TIMESTAMP = 7,      // Field::pattern, e.g. %Y-%m-%d %H:%M:%S
+        KIND_COUNT = 8
+    };
+
     enum {
         EOL_UNIX = 0,
         EOL_DOS = 1
@@ -29,6 +56,8 @@ namespace csvlint {
         string name;
         int type;                // numeric / nominal / string
         bool quoted;
+        int kind;
+        string pattern;          // of dates and timestamps
         //vector<string> values;   // values for nominal fields
     };
 
@@ -39,6 +68,8 @@ namespace csvlint {
         double p5, p25, p50, p75, p95;
     };
 
+    char const *kind_name (int kind);
+
     class crange: public ::boost::iterator_range<const char*> {
         bool na;
     public:
@@ -58,9 +89,77 @@ namespace csvlint {
 
     ostream &operator << (ostream &os, crange e);
 
+    union Value {
+        int64_t i;              // bool, integers, days or seconds since the epoch
+        double d;               // float64
+    };
+
+    // Converts a non-missing cell of a field to its kind; false if it does
+    // not parse.  Null for string and categorical kinds.
+    typedef bool (*Kernel)(crange, Field const &, Value *);
+    Kernel kernel (int kind);
+
+    // The next kind up whose kernel accepts every value of kind's:
+    // int32, int64, float64, then string; any other kind goes to string.
+    int widen (int kind);
+
+    // write(2) all of [buf, buf + sz), retrying short writes
+    void write_fully (int fd, char const *buf, size_t sz);
+    // writev(2) all spans, IOV_MAX at a time; *spans is consumed
+    void writev_fully (int fd, vector<iovec> *spans);
+
+    // Buffered output.  Whole spans are appended to a reusable buffer
+    // which is flushed to fd with write(2) once it reaches capacity.
+    // With fd < 0 nothing is flushed and the bytes are left for the
+    // caller (e.g. a per-chunk buffer committed later).
+    class Writer {
+        int fd;
+        size_t capacity;
+        string buf;
+    public:
+        static size_t const DEFAULT_CAPACITY = 4 * 1024 * 1024;
+
+        Writer (int fd_ = -1, size_t cap = DEFAULT_CAPACITY): fd(fd_), capacity(cap) {
+            buf.reserve(capacity);
+        }
+
+        ~Writer () {
+            flush();
+        }
+
+        void put (char c) {
+            buf.push_back(c);
+            if (buf.size() >= capacity) flush();
+        }
+
+        void write (char const *p, size_t n) {
+            buf.append(p, n);
+            if (buf.size() >= capacity) flush();
+        }
+
+        void write (crange e) {
+            write(e.begin(), e.size());
+        }
+
+        void write (string const &s) {
+            write(s.data(), s.size());
+        }
+
+        void flush () {
+            if (fd < 0 || buf.empty()) return;
+            write_fully(fd, buf.data(), buf.size());
+            buf.clear();
+        }
+
+        string &buffer () {
+            return buf;
+        }
+    };
+
     struct Format {
     private:
         void trainField (vector<crange> const &, Field *, FieldExt *);
+        void train (Text &lines);
     public:
         int eol_type;            // end of line types, could be multiple chars
         string eol_str;
@@ -74,13 +173,27 @@ namespace csvlint {
         size_t data_offset;
         size_t max_line;
         vector<Field> fields;
+        string source;           // size, mtime and head hash of the trained input
+        size_t sample;           // sample budget train was given, in bytes
+        string fs_tried;         // COMMON_FS and COMMON_QUOTE when trained
+        string quote_tried;
+        // load/save throw runtime_error on failure
         void load (string const &path);
-        void save (string const &path);
+        void save (string const &path) const;
         void train (string const &path, size_t max_buffer = 0x6400000); // 100MB
+        // Uses the format cached in <path>.csvlint if it was trained on
+        // the same input with at least max_buffer bytes and at least the
+        // current separator and quote candidates, otherwise trains and
+        // refreshes the cache.
+        void open (string const &path, size_t max_buffer = 0x6400000);
         void summary (ostream &os, bool details) const;
         // whether parse successful
         bool parse (crange in, vector<crange> *out) const;
+        void write_header (Writer &w) const;
+        void write_line (Writer &w, vector<crange> const &) const;
         void write_header (ostream &os) const;
         void write_line (ostream &os, vector<crange> const &) const;
     };
 }
+
+#endif
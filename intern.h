@@ -0,0 +1,154 @@
+#ifndef AAALGO_INTERN
+#define AAALGO_INTERN
+
+#include <stdint.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include <utility>
+#include "arena.h"
+#include "sketch.h"
+
+// Open-addressing hash table keyed by byte strings.
+//
+// Keys are looked up by pointer and length, so probing a value straight
+// out of the input allocates nothing.  A new key is copied once into an
+// arena; slots keep its hash, so probes compare hashes before bytes and
+// rehashing never rereads keys.  Linear probing, at most 70% full.
+//
+// Slot pointers are invalidated by the next insert that adds a key.
+template <typename V>
+class InternTable {
+public:
+    struct Slot {
+        uint64_t hash;
+        char const *data;       // null: empty slot
+        size_t size;
+        V value;
+
+        std::string key () const {
+            return std::string(data, size);
+        }
+    };
+
+private:
+    std::vector<Slot> slots;
+    size_t used;
+    Arena arena;
+
+    void grow () {
+        std::vector<Slot> old(slots.empty() ? 16 : slots.size() * 2);
+        old.swap(slots);
+        size_t mask = slots.size() - 1;
+        for (auto &s: old) {
+            if (!s.data) continue;
+            size_t i = s.hash & mask;
+            while (slots[i].data) i = (i + 1) & mask;
+            slots[i] = std::move(s);
+        }
+    }
+
+    // index of the slot holding key [p, p + n) with hash h, or of the
+    // empty slot ending its probe sequence; slots must not be empty
+    size_t probe (char const *p, size_t n, uint64_t h) const {
+        size_t mask = slots.size() - 1;
+        size_t i = h & mask;
+        while (slots[i].data) {
+            Slot const &s = slots[i];
+            if (s.hash == h && s.size == n && memcmp(s.data, p, n) == 0) break;
+            i = (i + 1) & mask;
+        }
+        return i;
+    }
+
+public:
+    // keys are copied into arena blocks of `block` bytes
+    explicit InternTable (size_t block = Arena::DEFAULT_BLOCK): used(0), arena(block) {
+    }
+
+    InternTable (InternTable &&) = default;
+    InternTable &operator = (InternTable &&) = default;
+
+    static uint64_t hash (char const *p, size_t n) {
+        return sketch::hash_bytes(p, n);
+    }
+
+    // the slot of key [p, p + n), added with a default value if missing;
+    // second is true if it was added.  Only adding a key can rehash.
+    std::pair<Slot *, bool> insert (char const *p, size_t n, uint64_t h) {
+        size_t i = slots.empty() ? 0 : probe(p, n, h);
+        if (slots.size() && slots[i].data) {
+            return std::make_pair(&slots[i], false);
+        }
+        if ((used + 1) * 10 > slots.size() * 7) {
+            grow();
+            i = probe(p, n, h);
+        }
+        Slot &s = slots[i];
+        s.hash = h;
+        s.data = arena.copy(p, n);
+        s.size = n;
+        s.value = V();
+        ++used;
+        return std::make_pair(&s, true);
+    }
+
+    std::pair<Slot *, bool> insert (char const *p, size_t n) {
+        return insert(p, n, hash(p, n));
+    }
+
+    V &operator [] (std::string const &key) {
+        return insert(key.data(), key.size()).first->value;
+    }
+
+    // null if missing
+    Slot *find (char const *p, size_t n, uint64_t h) {
+        if (slots.empty()) return nullptr;
+        size_t i = probe(p, n, h);
+        return slots[i].data ? &slots[i] : nullptr;
+    }
+
+    Slot *find (char const *p, size_t n) {
+        return find(p, n, hash(p, n));
+    }
+
+    size_t size () const {
+        return used;
+    }
+
+    bool empty () const {
+        return used == 0;
+    }
+
+    // f(Slot &) for every key, in no particular order
+    template <typename F>
+    void for_each (F const &f) {
+        for (auto &s: slots) {
+            if (s.data) f(s);
+        }
+    }
+
+    template <typename F>
+    void for_each (F const &f) const {
+        for (auto const &s: slots) {
+            if (s.data) f(s);
+        }
+    }
+
+    void swap (InternTable &o) {
+        std::swap(*this, o);
+    }
+
+    // memory held: the slots and the arena blocks keys are copied into
+    size_t bytes () const {
+        return slots.capacity() * sizeof(Slot) + arena.bytes();
+    }
+
+    void clear () {
+        std::vector<Slot>().swap(slots);
+        used = 0;
+        arena.clear();
+    }
+};
+
+#endif
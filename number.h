@@ -0,0 +1,126 @@
+#ifndef AAALGO_NUMBER
+#define AAALGO_NUMBER
+
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+#include <limits>
+#include <string>
+
+// Validate and convert a numeric cell in one pass.
+//
+// Accepts what csvlint calls numeric: an optional '-', digits and at most
+// one '.', with at least one digit.  Digits are consumed 8 at a time with
+// SWAR while they fit in 19 digits.  The double is exact when the digits
+// fit in 53 bits and there are at most 22 decimals (Clinger's fast path:
+// one correctly rounded division by an exact power of ten); anything else
+// goes through strtod.
+namespace number {
+
+    enum {
+        NOT_NUMBER = 0,
+        INTEGER = 1,        // -?[0-9]+
+        DECIMAL = 2,        // with a '.'
+        BIG_INTEGER = 3     // INTEGER that does not fit in int64
+    };
+
+    namespace detail {
+        // all 8 bytes at p are '0'..'9'
+        inline bool eight_digits (char const *p) {
+            uint64_t w;
+            memcpy(&w, p, 8);
+            return ((w & 0xF0F0F0F0F0F0F0F0ULL)
+                    | (((w + 0x0606060606060606ULL) & 0xF0F0F0F0F0F0F0F0ULL) >> 4))
+                   == 0x3333333333333333ULL;
+        }
+
+        // value of 8 digits at p, little-endian
+        inline uint32_t parse_eight (char const *p) {
+            uint64_t w;
+            memcpy(&w, p, 8);
+            w = (w & 0x0F0F0F0F0F0F0F0FULL) * 2561 >> 8;
+            w = (w & 0x00FF00FF00FF00FFULL) * 6553601 >> 16;
+            return uint32_t((w & 0x0000FFFF0000FFFFULL) * 42949672960001ULL >> 32);
+        }
+
+        // Appends the digits at *p to *m, at most 19 in all (*n counts
+        // them); more set *overflow and are skipped.  Returns how many
+        // digits were consumed.
+        inline size_t digits (char const *&p, char const *e, uint64_t *m, unsigned *n, bool *overflow) {
+            char const *b = p;
+            while (e - p >= 8 && *n + 8 <= 19 && eight_digits(p)) {
+                *m = *m * 100000000 + parse_eight(p);
+                *n += 8;
+                p += 8;
+            }
+            while (p < e && unsigned(*p - '0') < 10) {
+                if (*n < 19) {
+                    *m = *m * 10 + (*p - '0');
+                    ++*n;
+                }
+                else {
+                    *overflow = true;
+                }
+                ++p;
+            }
+            return p - b;
+        }
+
+        inline double slow (char const *b, char const *e) {
+            char buf[64];
+            size_t n = e - b;
+            if (n < sizeof(buf)) {
+                memcpy(buf, b, n);
+                buf[n] = 0;
+                return strtod(buf, nullptr);
+            }
+            return strtod(std::string(b, e).c_str(), nullptr);
+        }
+    }
+
+    // Returns the kind of [b, e) and, unless NOT_NUMBER, its value in
+    // *value; INTEGER values are also stored in *integer if given.
+    inline int parse (char const *b, char const *e, double *value, int64_t *integer = nullptr) {
+        static double const POW10[] = {
+            1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+            1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+        };
+        char const *p = b;
+        bool neg = false;
+        if (p < e && *p == '-') {
+            neg = true;
+            ++p;
+        }
+        uint64_t m = 0;
+        unsigned n = 0;
+        bool overflow = false;
+        size_t whole = detail::digits(p, e, &m, &n, &overflow);
+        bool dot = false;
+        unsigned decimals = 0;
+        if (p < e && *p == '.') {
+            dot = true;
+            ++p;
+            unsigned before = n;
+            size_t fraction = detail::digits(p, e, &m, &n, &overflow);
+            if (whole + fraction == 0) return NOT_NUMBER;
+            decimals = n - before;
+        }
+        else if (whole == 0) {
+            return NOT_NUMBER;
+        }
+        if (p != e) return NOT_NUMBER;
+        if (!overflow && m <= (uint64_t(1) << 53) && decimals <= 22) {
+            double v = double(m) / POW10[decimals];
+            *value = neg ? -v : v;
+        }
+        else {
+            *value = detail::slow(b, e);
+        }
+        if (dot) return DECIMAL;
+        if (overflow || m > uint64_t(std::numeric_limits<int64_t>::max()) + neg) return BIG_INTEGER;
+        if (integer) *integer = neg ? int64_t(0 - m) : int64_t(m);
+        return INTEGER;
+    }
+}
+
+#endif
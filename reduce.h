@@ -0,0 +1,27 @@
+#ifndef AAALGO_REDUCE
+#define AAALGO_REDUCE
+
+#include <vector>
+
+// Folds every part's columns into parts[0], pairing parts i and i + step
+// for step = 1, 2, 4, ...; the column merges of one round run in
+// parallel.  A part is a vector of `columns` partial aggregates, each
+// with merge(C &o) folding o in; merged parts are freed after a round.
+template <typename C>
+void reduce (std::vector<std::vector<C>> &parts, unsigned columns) {
+    for (size_t step = 1; step < parts.size(); step *= 2) {
+        size_t pairs = (parts.size() + 2 * step - 1) / (2 * step);
+#pragma omp parallel for schedule(dynamic, 1)
+        for (size_t k = 0; k < pairs * columns; ++k) {
+            size_t to = k / columns * 2 * step;
+            size_t from = to + step;
+            if (from >= parts.size()) continue;
+            parts[to][k % columns].merge(parts[from][k % columns]);
+        }
+        for (size_t i = 0; i + step < parts.size(); i += 2 * step) {
+            std::vector<C>().swap(parts[i + step]);
+        }
+    }
+}
+
+#endif
@@ -0,0 +1,169 @@
+#ifndef AAALGO_REWRITE
+#define AAALGO_REWRITE
+
+#include "csvlint.h"
+#include "bigtext.h"
+
+namespace csvlint {
+
+    struct RewriteChunk {
+        string out;
+        vector<iovec> spans;    // passthrough: raw input spans for writev
+        size_t bad;
+    };
+
+    // spans shorter than this on average are cheaper to copy than to writev
+    static size_t const MIN_PASSTHROUGH_SPAN = 64;
+
+    // Whether a kept field has identical bytes in both formats, so lines
+    // can be re-emitted as raw spans of the input without unquote/requote.
+    inline bool is_passthrough (Format const &from, Format const &to) {
+        if (from.fs_char != to.fs_char) return false;
+        if (from.quote_char != to.quote_char) return false;
+        if (from.eol_str != to.eol_str) return false;
+        if (from.na_str != to.na_str) return false;
+        for (auto const &f: to.fields) {
+            if (f.quoted != from.fields[f.column].quoted) return false;
+        }
+        return true;
+    }
+
+    // Appends the raw bytes of the kept fields of a parsed line to spans,
+    // extending the last span whenever the input bytes are contiguous, so
+    // a projection that keeps neighbouring columns becomes a few large
+    // spans per block.  content_end is the line end without terminator,
+    // eol the terminator bytes in the input (nullptr if missing).
+    inline void passthrough_line (Format const &to, vector<crange> const &cols,
+                                  char const *content_end, char const *eol,
+                                  vector<iovec> *spans) {
+        auto add = [spans](char const *p, size_t n) {
+            if (spans->size()) {
+                iovec &last = spans->back();
+                if (reinterpret_cast<char const *>(last.iov_base) + last.iov_len == p) {
+                    last.iov_len += n;
+                    return;
+                }
+            }
+            spans->push_back(iovec{const_cast<char *>(p), n});
+        };
+        char const *prev = nullptr;
+        for (auto const &f: to.fields) {
+            crange const &e = cols[f.column];
+            char const *b = e.begin();
+            char const *x = e.end();
+            if (!e.missing() && f.quoted) {
+                --b;
+                ++x;
+            }
+            if (prev) {
+                // a field not ending the line is followed by its separator
+                add(prev < content_end ? prev : &to.fs_char, 1);
+            }
+            add(b, x - b);
+            prev = x;
+        }
+        if (eol && prev == content_end) {
+            add(eol, to.eol_str.size());
+        }
+        else {
+            add(to.eol_str.data(), to.eol_str.size());
+        }
+    }
+
+    // Parses the data lines of input (trained as from) and re-serializes
+    // them with format to.  Chunks are converted in parallel, each into
+    // its own buffer, and written to fd in input order.  When the formats
+    // agree the lines are passed through as raw spans and written with
+    // writev.  Lines that fail to parse are skipped; returns their number.
+    inline size_t rewrite (string const &input, Format const &from, Format const &to, int fd) {
+        {
+            Writer w(fd);
+            to.write_header(w);
+        }
+        bool pass = is_passthrough(from, to);
+        BigText<RewriteChunk> text(input, from.data_offset, '\n', from.max_line, 10 * 1024 * 1024, true);
+        text.set_drop_behind(true);
+        text.ordered([&from, &to, pass](char const *b, char const *e, RewriteChunk *ch) {
+            Writer w(-1, pass ? 0 : (e - b) + (e - b) / 4);
+            vector<crange> cols;
+            auto line = [&](char const *lb, char const *le) {
+                if (!from.parse(crange(lb, le), &cols)) {
+                    ++ch->bad;
+                    return;
+                }
+                if (pass) {
+                    char const *eol = nullptr;
+                    char const *content_end = le;
+                    if (le[-1] == '\n') {
+                        eol = content_end = le - from.eol_str.size();
+                    }
+                    passthrough_line(to, cols, content_end, eol, &ch->spans);
+                }
+                else {
+                    to.write_line(w, cols);
+                }
+            };
+            char const *lb = b;
+            structural::for_each(b, e, '\n', [&](char const *p) {
+                line(lb, p + 1);
+                lb = p + 1;
+            });
+            if (lb < e) line(lb, e);
+            if (pass) {
+                size_t total = 0;
+                for (auto const &v: ch->spans) {
+                    total += v.iov_len;
+                }
+                if (total < ch->spans.size() * MIN_PASSTHROUGH_SPAN) {
+                    // too fragmented, gather instead
+                    w.buffer().reserve(total);
+                    for (auto const &v: ch->spans) {
+                        w.write(reinterpret_cast<char const *>(v.iov_base), v.iov_len);
+                    }
+                    vector<iovec>().swap(ch->spans);
+                }
+            }
+            ch->out.swap(w.buffer());
+        }, [fd](RewriteChunk *ch) {
+            if (ch->spans.size()) {
+                writev_fully(fd, &ch->spans);
+                vector<iovec>().swap(ch->spans);
+            }
+            else {
+                write_fully(fd, ch->out.data(), ch->out.size());
+                string().swap(ch->out);
+            }
+        });
+        size_t bad = 0;
+        for (auto const &ch: text) {
+            bad += ch.bad;
+        }
+        return bad;
+    }
+
+    // Like rewrite(), but only data records [first, last) of input, read
+    // through its row index instead of scanning up to them.
+    inline size_t rewrite_rows (string const &input, RowIndex const &idx, uint64_t first, uint64_t last,
+                                Format const &from, Format const &to, int fd) {
+        int in = ::open(input.c_str(), O_RDONLY);
+        if (in < 0) {
+            std::cerr << "open(" << input << "): " << strerror(errno) << std::endl;
+            BOOST_VERIFY(0);
+        }
+        Writer w(fd);
+        to.write_header(w);
+        vector<crange> cols;
+        size_t bad = 0;
+        read_rows(in, idx, first, last, [&](char const *b, char const *e) {
+            if (!from.parse(crange(b, e), &cols)) {
+                ++bad;
+                return;
+            }
+            to.write_line(w, cols);
+        });
+        close(in);
+        return bad;
+    }
+}
+
+#endif
@@ -0,0 +1,191 @@
+#ifndef AAALGO_ROWINDEX
+#define AAALGO_ROWINDEX
+
+#include <stdint.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <string>
+#include <vector>
+#include <fstream>
+#include <iostream>
+#include <algorithm>
+#include <boost/assert.hpp>
+#include "structural.h"
+
+// Record offsets of a text file.
+//
+// For every BigText block we keep its byte range, how many records it
+// holds and the offset of every stride-th record in it, so record k is
+// found with a binary search over blocks and a scan of fewer than stride
+// lines.  BigText::lines builds it as a by-product; it is saved next to
+// the input and only trusted while the file size and mtime match.
+class RowIndex {
+public:
+    struct Block {
+        uint64_t begin;
+        uint64_t end;
+        uint64_t first;                 // number of the block's first record
+        uint64_t records;
+        std::vector<uint64_t> marks;    // offsets of records 0, stride, 2 * stride, ...
+    };
+
+    static unsigned const DEFAULT_STRIDE = 4096;
+
+    unsigned stride;
+    char delimiter;
+    uint64_t size;                      // of the indexed file, with mtime
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+    std::vector<Block> blocks;
+
+    RowIndex (unsigned stride_ = DEFAULT_STRIDE): stride(stride_), delimiter('\n'), size(0), mtime_sec(0), mtime_nsec(0) {
+    }
+
+    static std::string sidecar (std::string const &input) {
+        return input + ".rows";
+    }
+
+    void stamp (struct stat const &st) {
+        size = st.st_size;
+        mtime_sec = st.st_mtim.tv_sec;
+        mtime_nsec = st.st_mtim.tv_nsec;
+    }
+
+    // fill in Block::first once all blocks are counted
+    void finish () {
+        uint64_t n = 0;
+        for (auto &b: blocks) {
+            b.first = n;
+            n += b.records;
+        }
+    }
+
+    uint64_t records () const {
+        return blocks.empty() ? 0 : blocks.back().first + blocks.back().records;
+    }
+
+    // Offset of the last mark at or before record k, and the number of
+    // records between the two.  k == records() locates the end of data.
+    std::pair<uint64_t, uint64_t> locate (uint64_t k) const {
+        BOOST_VERIFY(k <= records());
+        if (k == records()) {
+            return std::make_pair(blocks.empty() ? 0 : blocks.back().end, uint64_t(0));
+        }
+        auto it = std::upper_bound(blocks.begin(), blocks.end(), k, [](uint64_t v, Block const &b) {
+            return v < b.first;
+        });
+        --it;
+        while (it->records == 0) ++it;  // skip empty blocks
+        uint64_t j = k - it->first;
+        return std::make_pair(it->marks[j / stride], j % stride);
+    }
+
+    bool save (std::string const &path) const {
+        std::ofstream os(path.c_str(), std::ios::binary);
+        if (!os) return false;
+        uint64_t head[] = {MAGIC, VERSION, stride, uint64_t(uint8_t(delimiter)), size,
+                           uint64_t(mtime_sec), uint64_t(mtime_nsec), blocks.size()};
+        os.write(reinterpret_cast<char const *>(head), sizeof(head));
+        for (auto const &b: blocks) {
+            uint64_t v[] = {b.begin, b.end, b.records, b.marks.size()};
+            os.write(reinterpret_cast<char const *>(v), sizeof(v));
+            os.write(reinterpret_cast<char const *>(b.marks.data()), b.marks.size() * sizeof(uint64_t));
+        }
+        return bool(os);
+    }
+
+    // false if the sidecar is missing, damaged, or older than input
+    bool load (std::string const &path, std::string const &input) {
+        struct stat st;
+        if (stat(input.c_str(), &st) != 0) return false;
+        std::ifstream is(path.c_str(), std::ios::binary);
+        uint64_t head[8];
+        if (!is.read(reinterpret_cast<char *>(head), sizeof(head))) return false;
+        if (head[0] != MAGIC || head[1] != VERSION) return false;
+        if (head[4] != uint64_t(st.st_size)
+                || int64_t(head[5]) != st.st_mtim.tv_sec
+                || int64_t(head[6]) != st.st_mtim.tv_nsec) return false;
+        stride = head[2];
+        delimiter = char(head[3]);
+        stamp(st);
+        blocks.resize(head[7]);
+        for (auto &b: blocks) {
+            uint64_t v[4];
+            if (!is.read(reinterpret_cast<char *>(v), sizeof(v))) return false;
+            b.begin = v[0];
+            b.end = v[1];
+            b.records = v[2];
+            if (v[3] != (b.records + stride - 1) / stride) return false;
+            b.marks.resize(v[3]);
+            if (!is.read(reinterpret_cast<char *>(b.marks.data()), b.marks.size() * sizeof(uint64_t))) return false;
+        }
+        finish();
+        return true;
+    }
+
+private:
+    static uint64_t const MAGIC = 0x73776f726c767363ULL;   // "csvlrows"
+    static uint64_t const VERSION = 1;
+};
+
+// Calls cb(begin, end) for records [from, to) of fd; end includes the
+// delimiter if there is one.  Like BigText's, the callback is a template
+// parameter.
+template <typename F>
+void read_rows (int fd, RowIndex const &idx, uint64_t from, uint64_t to, F const &cb) {
+    static size_t const BUF = 1 << 20;
+    auto at = idx.locate(from);
+    uint64_t off = at.first;
+    uint64_t skip = at.second;
+    uint64_t n = to - from;
+    uint64_t end = idx.blocks.empty() ? 0 : idx.blocks.back().end;
+    std::string buf;
+    size_t used = 0;            // bytes of buf already consumed
+    while (n && off < end) {
+        size_t keep = buf.size() - used;
+        buf.erase(0, used);
+        used = 0;
+        size_t want = std::min<uint64_t>(BUF, end - off);
+        buf.resize(keep + want);
+        ssize_t r = pread(fd, &buf[keep], want, off);
+        if (r <= 0) {
+            std::cerr << "pread(" << fd << ", ..., " << want << ", " << off << "): " << strerror(errno) << std::endl;
+            BOOST_VERIFY(0);
+        }
+        off += r;
+        buf.resize(keep + r);
+        char const *b = &buf[0];
+        char const *e = b + buf.size();
+        char const *p = b;
+        structural::for_each(b + keep, e, idx.delimiter, [&](char const *le) {
+            if (n == 0) return;
+            if (skip) {
+                --skip;
+            }
+            else {
+                cb(p, le + 1);
+                --n;
+            }
+            p = le + 1;
+        });
+        used = p - b;
+    }
+    if (n && !skip && used < buf.size()) {
+        cb(&buf[used], &buf[0] + buf.size());   // last record without delimiter
+    }
+}
+
+// offset of record k of fd
+inline uint64_t seek_row (int fd, RowIndex const &idx, uint64_t k) {
+    auto at = idx.locate(k);
+    uint64_t off = at.first;
+    // add up the records between the mark and k
+    read_rows(fd, idx, k - at.second, k, [&off](char const *b, char const *e) {
+        off += e - b;
+    });
+    return off;
+}
+
+#endif
@@ -0,0 +1,371 @@
+#ifndef AAALGO_SKETCH
+#define AAALGO_SKETCH
+
+#include <stdint.h>
+#include <string.h>
+#include <cmath>
+#include <limits>
+#include <string>
+#include <vector>
+#include <utility>
+#include <algorithm>
+#include <unordered_map>
+
+// Mergeable summaries.
+//
+// Each is updated per chunk by one thread and folded into another of
+// the same kind afterwards, so chunks can be summarized in parallel and
+// reduced in any order.
+namespace sketch {
+
+    // count, mean and sum of squared deviations; merged with Chan et al.
+    struct Moments {
+        double n;
+        double mean;
+        double m2;
+
+        Moments (): n(0), mean(0), m2(0) {
+        }
+
+        void add (double x) {
+            n += 1;
+            double d = x - mean;
+            mean += d / n;
+            m2 += d * (x - mean);
+        }
+
+        void merge (Moments const &o) {
+            if (o.n == 0) return;
+            double t = n + o.n;
+            double d = o.mean - mean;
+            mean += d * o.n / t;
+            m2 += o.m2 + d * d * n * o.n / t;
+            n = t;
+        }
+
+        // population variance, as boost::accumulators computes it
+        double variance () const {
+            return n > 0 ? m2 / n : 0;
+        }
+    };
+
+    // Merging t-digest (Dunning & Ertl).  Values are buffered and folded
+    // into centroids in sorted batches; a centroid may hold more weight
+    // the closer it is to the median (scale function k1), so quantile
+    // error is smallest at the tails.  Min and max are exact.
+    class TDigest {
+        typedef std::pair<double, double> Centroid;    // mean, weight
+        double compression;
+        double total;
+        double lo;
+        double hi;
+        std::vector<Centroid> centroids;
+        std::vector<Centroid> buffer;
+
+        double k (double q) const {
+            return compression / (2 * M_PI) * asin(2 * q - 1);
+        }
+
+        double k_inverse (double v) const {
+            return (sin(v * 2 * M_PI / compression) + 1) / 2;
+        }
+
+        void compress () {
+            if (buffer.empty()) return;
+            buffer.insert(buffer.end(), centroids.begin(), centroids.end());
+            std::sort(buffer.begin(), buffer.end());
+            centroids.clear();
+            double done = 0;
+            Centroid cur = buffer[0];
+            double limit = total * k_inverse(k(0) + 1);
+            for (size_t i = 1; i < buffer.size(); ++i) {
+                Centroid const &c = buffer[i];
+                if (done + cur.second + c.second <= limit) {
+                    cur.second += c.second;
+                    cur.first += (c.first - cur.first) * c.second / cur.second;
+                }
+                else {
+                    done += cur.second;
+                    centroids.push_back(cur);
+                    limit = total * k_inverse(k(done / total) + 1);
+                    cur = c;
+                }
+            }
+            centroids.push_back(cur);
+            buffer.clear();
+        }
+
+    public:
+        TDigest (double c = 100): compression(c), total(0),
+            lo(std::numeric_limits<double>::infinity()),
+            hi(-std::numeric_limits<double>::infinity()) {
+        }
+
+        void add (double x, double w = 1) {
+            buffer.push_back(Centroid(x, w));
+            total += w;
+            if (x < lo) lo = x;
+            if (x > hi) hi = x;
+            if (buffer.size() >= 8 * compression) compress();
+        }
+
+        void merge (TDigest const &o) {
+            buffer.insert(buffer.end(), o.centroids.begin(), o.centroids.end());
+            buffer.insert(buffer.end(), o.buffer.begin(), o.buffer.end());
+            total += o.total;
+            if (o.lo < lo) lo = o.lo;
+            if (o.hi > hi) hi = o.hi;
+            compress();
+        }
+
+        double count () const {
+            return total;
+        }
+
+        // q in [0, 1]; NaN if empty
+        double quantile (double q) {
+            compress();
+            if (centroids.empty()) return std::numeric_limits<double>::quiet_NaN();
+            if (q <= 0) return lo;
+            if (q >= 1) return hi;
+            double index = q * total;
+            // centroid i is taken to sit at rank (weight before it) + w/2
+            double before = 0;
+            double prev_rank = 0;
+            double prev_mean = lo;
+            for (auto const &c: centroids) {
+                double rank = before + c.second / 2;
+                if (index < rank) {
+                    double t = (rank > prev_rank) ? (index - prev_rank) / (rank - prev_rank) : 0;
+                    return prev_mean + t * (c.first - prev_mean);
+                }
+                prev_rank = rank;
+                prev_mean = c.first;
+                before += c.second;
+            }
+            double t = (total > prev_rank) ? (index - prev_rank) / (total - prev_rank) : 0;
+            return prev_mean + t * (hi - prev_mean);
+        }
+    };
+
+    inline uint64_t mix64 (uint64_t x) {
+        x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+        return x ^ (x >> 31);
+    }
+
+    // 64-bit hash of n bytes at p, 8 bytes at a time
+    inline uint64_t hash_bytes (char const *p, size_t n) {
+        uint64_t h = 0x9e3779b97f4a7c15ULL ^ (n * 0xff51afd7ed558ccdULL);
+        while (n >= 8) {
+            uint64_t w;
+            memcpy(&w, p, 8);
+            h = mix64(h ^ w);
+            p += 8;
+            n -= 8;
+        }
+        if (n) {
+            uint64_t w = 0;
+            memcpy(&w, p, n);
+            h = mix64(h ^ w ^ 0x5851f42d4c957f2dULL);
+        }
+        return h;
+    }
+
+    // HyperLogLog with 2^12 registers (~1.6% standard error), linear
+    // counting while registers are still mostly empty.  Registers are
+    // allocated on first use.
+    class HyperLogLog {
+        static unsigned const P = 12;
+        static unsigned const M = 1 << P;
+        std::vector<uint8_t> regs;
+    public:
+        void add (uint64_t h) {
+            if (regs.empty()) regs.resize(M, 0);
+            unsigned i = h >> (64 - P);
+            uint64_t rest = (h << P) | (uint64_t(1) << (P - 1));  // guard bit bounds the rank
+            uint8_t rank = __builtin_clzll(rest) + 1;
+            if (rank > regs[i]) regs[i] = rank;
+        }
+
+        void merge (HyperLogLog const &o) {
+            if (o.regs.empty()) return;
+            if (regs.empty()) {
+                regs = o.regs;
+                return;
+            }
+            for (unsigned i = 0; i < M; ++i) {
+                if (o.regs[i] > regs[i]) regs[i] = o.regs[i];
+            }
+        }
+
+        double estimate () const {
+            if (regs.empty()) return 0;
+            double sum = 0;
+            unsigned zeros = 0;
+            for (uint8_t r: regs) {
+                sum += ldexp(1.0, -int(r));
+                if (r == 0) ++zeros;
+            }
+            double e = 0.7213 / (1 + 1.079 / M) * M * M / sum;
+            if (e <= 2.5 * M && zeros) {
+                e = M * log(double(M) / zeros);
+            }
+            return e;
+        }
+    };
+
+    // SpaceSaving heavy hitters (Metwally et al.): `capacity` counters in
+    // a min-heap keyed by count.  An unseen value takes over the smallest
+    // counter, inheriting its count as error.  Values are looked up by
+    // hash, so a string is only built for values that get a counter.
+    class SpaceSaving {
+    public:
+        struct Counter {
+            uint64_t hash;
+            size_t count;
+            size_t error;
+            std::string value;
+        };
+    private:
+        size_t capacity;
+        bool evicted;
+        std::vector<Counter> heap;
+        std::unordered_map<uint64_t, size_t> pos;
+
+        void swap (size_t a, size_t b) {
+            std::swap(heap[a], heap[b]);
+            pos[heap[a].hash] = a;
+            pos[heap[b].hash] = b;
+        }
+
+        void sift_up (size_t i) {
+            while (i && heap[(i - 1) / 2].count > heap[i].count) {
+                swap(i, (i - 1) / 2);
+                i = (i - 1) / 2;
+            }
+        }
+
+        void sift_down (size_t i) {
+            for (;;) {
+                size_t m = i;
+                size_t l = 2 * i + 1;
+                size_t r = l + 1;
+                if (l < heap.size() && heap[l].count < heap[m].count) m = l;
+                if (r < heap.size() && heap[r].count < heap[m].count) m = r;
+                if (m == i) return;
+                swap(i, m);
+                i = m;
+            }
+        }
+
+        // count a value missing from this summary may have had
+        size_t floor () const {
+            return evicted ? heap[0].count : 0;
+        }
+
+        void rebuild (std::vector<Counter> &&v) {
+            heap = std::move(v);
+            pos.clear();
+            std::make_heap(heap.begin(), heap.end(), [](Counter const &a, Counter const &b) {
+                return a.count > b.count;
+            });
+            for (size_t i = 0; i < heap.size(); ++i) {
+                pos[heap[i].hash] = i;
+            }
+        }
+    public:
+        SpaceSaving (size_t c = 256): capacity(c), evicted(false) {
+        }
+
+        void add (char const *p, size_t n, uint64_t h) {
+            auto it = pos.find(h);
+            if (it != pos.end()) {
+                ++heap[it->second].count;
+                sift_down(it->second);
+                return;
+            }
+            if (heap.size() < capacity) {
+                heap.push_back(Counter{h, 1, 0, std::string(p, n)});
+                pos[h] = heap.size() - 1;
+                sift_up(heap.size() - 1);
+                return;
+            }
+            evicted = true;
+            Counter &c = heap[0];
+            pos.erase(c.hash);
+            c.hash = h;
+            c.error = c.count;
+            ++c.count;
+            c.value.assign(p, n);
+            pos[h] = 0;
+            sift_down(0);
+        }
+
+        // Mergeable summaries (Agarwal et al.): a value missing on one
+        // side is charged that side's floor, then the largest counters
+        // are kept.
+        void merge (SpaceSaving const &o) {
+            size_t mine = floor();
+            size_t theirs = o.floor();
+            std::unordered_map<uint64_t, Counter> all;
+            for (auto const &c: heap) {
+                Counter &a = all[c.hash];
+                a = c;
+                a.count += theirs;
+                a.error += theirs;
+            }
+            for (auto const &c: o.heap) {
+                auto it = all.find(c.hash);
+                if (it == all.end()) {
+                    Counter &a = all[c.hash];
+                    a = c;
+                    a.count += mine;
+                    a.error += mine;
+                }
+                else {
+                    it->second.count += c.count - theirs;
+                    it->second.error += c.error - theirs;
+                }
+            }
+            std::vector<Counter> v;
+            v.reserve(all.size());
+            for (auto &p: all) {
+                v.push_back(std::move(p.second));
+            }
+            evicted = evicted || o.evicted || v.size() > capacity;
+            if (v.size() > capacity) {
+                std::nth_element(v.begin(), v.begin() + capacity, v.end(), [](Counter const &a, Counter const &b) {
+                    return a.count > b.count;
+                });
+                v.resize(capacity);
+            }
+            rebuild(std::move(v));
+        }
+
+        // true if no value was ever dropped: counts are exact
+        bool exact () const {
+            return !evicted;
+        }
+
+        size_t size () const {
+            return heap.size();
+        }
+
+        // counters by decreasing guaranteed count (count - error), then
+        // decreasing count and value; a value's true count lies in
+        // [count - error, count]
+        std::vector<Counter> top (size_t k) const {
+            std::vector<Counter> v(heap);
+            std::sort(v.begin(), v.end(), [](Counter const &a, Counter const &b) {
+                size_t ga = a.count - a.error, gb = b.count - b.error;
+                if (ga != gb) return ga > gb;
+                return a.count != b.count ? a.count > b.count : a.value > b.value;
+            });
+            if (v.size() > k) v.resize(k);
+            return v;
+        }
+    };
+}
+
+#endif
@@ -0,0 +1,275 @@
+#ifndef AAALGO_SPILL
+#define AAALGO_SPILL
+
+#include <stdint.h>
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <atomic>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include <functional>
+#include <boost/assert.hpp>
+#include "sketch.h"
+#include "intern.h"
+
+// Exact value counts under a memory budget.
+//
+// Counters share one budget.  Once the bytes held by all of them go past
+// it, a counter that grows writes its table to a run file in the spill
+// directory and starts over, unless it is below the floor: a counter
+// that small is left alone, to avoid swarms of tiny runs.  The floor is
+// lowered by share() so that all counters below it together fit in half
+// the budget, whatever the thread and column counts, down to MIN_FLOOR.
+// A run is laid out as PARTITIONS sections by
+// value hash, so the final pass re-counts one partition at a time from
+// all runs and needs about 1/PARTITIONS of the memory.
+namespace spill {
+
+    static unsigned const PARTITIONS = 256;
+    // the floor when the budget is large enough
+    static size_t const MIN_SPILL = 1 << 20;
+    // and how low share() takes it, runs being written whole
+    static size_t const MIN_FLOOR = 16 << 10;
+
+    struct Budget {
+        size_t limit;                   // 0: unlimited
+        size_t floor;                   // smaller tables are not spilled
+        std::string dir;                // created by setup()
+        std::atomic<size_t> used;
+        std::atomic<unsigned> runs;
+
+        Budget (): limit(0), floor(MIN_SPILL), used(0), runs(0) {
+        }
+    };
+
+    inline Budget &budget () {
+        static Budget b;
+        return b;
+    }
+
+    // limit in bytes; runs go to a fresh directory under tmp
+    inline void setup (size_t limit, std::string const &tmp) {
+        Budget &b = budget();
+        b.limit = limit;
+        if (limit == 0) return;
+        std::string dir = tmp + "/csvlint-spill.XXXXXX";
+        if (!mkdtemp(&dir[0])) {
+            std::cerr << "mkdtemp(" << dir << "): " << strerror(errno) << std::endl;
+            BOOST_VERIFY(0);
+        }
+        b.dir = dir;
+    }
+
+    // Declares how many tables (counters and the like) may be held at
+    // once, so that the floor keeps them all within the budget.
+    inline void share (size_t tables) {
+        Budget &b = budget();
+        if (b.limit == 0 || tables == 0) return;
+        b.floor = std::min(MIN_SPILL, b.limit / (2 * tables));
+        if (b.floor < MIN_FLOOR) {
+            b.floor = MIN_FLOOR;
+            std::cerr << "memory limit too small for " << tables << " tables, it may be exceeded by up to "
+                      << (tables * MIN_FLOOR >> 20) << "MB." << std::endl;
+        }
+    }
+
+    // tables below this many bytes are not spilled or degraded
+    inline size_t floor () {
+        return budget().floor;
+    }
+
+    // Charges n bytes held outside a Counter to the budget; true if it
+    // is now exceeded.
+    inline bool charge (size_t n) {
+        Budget &b = budget();
+        size_t used = (b.used += n);
+        return b.limit && used > b.limit;
+    }
+
+    inline void refund (size_t n) {
+        budget().used -= n;
+    }
+
+    // removes the spill directory; runs are already gone
+    inline void cleanup () {
+        Budget &b = budget();
+        if (b.dir.size()) {
+            rmdir(b.dir.c_str());
+            b.dir.clear();
+        }
+    }
+
+    class Counter {
+        struct Run {
+            std::string path;
+            std::vector<uint64_t> offsets;  // PARTITIONS + 1 section bounds
+        };
+
+        typedef InternTable<size_t> Table;
+        Table table;
+        size_t bytes;
+        std::vector<Run> runs;
+
+        // top bits of the hash; the table itself indexes with the low ones
+        static unsigned partition (Table::Slot const &s) {
+            return s.hash >> 56;
+        }
+
+        // charges what the table grew by, spilling if over budget
+        void account () {
+            size_t now = table.bytes();
+            if (now <= bytes) return;
+            size_t n = now - bytes;
+            bytes = now;
+            if (charge(n) && bytes > floor()) {
+                spill();
+            }
+        }
+
+        void release () {
+            refund(bytes);
+            bytes = 0;
+            table.clear();
+        }
+
+        // writes the table to a new run, records [len:u32][bytes][count:u64]
+        void spill () {
+            if (table.empty()) return;
+            Budget &b = budget();
+            std::vector<std::vector<Table::Slot const *>> parts(PARTITIONS);
+            table.for_each([&parts](Table::Slot const &s) {
+                parts[partition(s)].push_back(&s);
+            });
+            Run run;
+            run.path = b.dir + "/run." + std::to_string(b.runs++);
+            std::ofstream os(run.path.c_str(), std::ios::binary);
+            uint64_t off = 0;
+            for (auto const &part: parts) {
+                run.offsets.push_back(off);
+                for (auto e: part) {
+                    uint32_t len = e->size;
+                    uint64_t count = e->value;
+                    os.write(reinterpret_cast<char const *>(&len), sizeof(len));
+                    os.write(e->data, len);
+                    os.write(reinterpret_cast<char const *>(&count), sizeof(count));
+                    off += sizeof(len) + len + sizeof(count);
+                }
+            }
+            run.offsets.push_back(off);
+            // the tail is only written out on close
+            os.close();
+            if (os.fail()) {
+                std::cerr << "cannot write " << run.path << ": " << strerror(errno) << std::endl;
+                BOOST_VERIFY(0);
+            }
+            runs.push_back(run);
+            release();
+        }
+
+        static void load (Run const &run, unsigned part, Table *to) {
+            uint64_t size = run.offsets[part + 1] - run.offsets[part];
+            if (size == 0) return;
+            std::string buf(size, '\0');
+            std::ifstream is(run.path.c_str(), std::ios::binary);
+            is.seekg(run.offsets[part]);
+            if (!is.read(&buf[0], size)) {
+                std::cerr << "cannot read " << run.path << ": " << strerror(errno) << std::endl;
+                BOOST_VERIFY(0);
+            }
+            char const *p = buf.data();
+            char const *e = p + size;
+            while (p < e) {
+                uint32_t len;
+                uint64_t count;
+                memcpy(&len, p, sizeof(len));
+                p += sizeof(len);
+                char const *v = p;
+                p += len;
+                memcpy(&count, p, sizeof(count));
+                p += sizeof(count);
+                to->insert(v, len).first->value += count;
+            }
+        }
+
+    public:
+        // a table with one block stays below the floor
+        Counter (): table(floor() / 2 < Arena::DEFAULT_BLOCK ? floor() / 2 : Arena::DEFAULT_BLOCK), bytes(0) {
+        }
+
+        Counter (Counter &&o): table(std::move(o.table)), bytes(o.bytes), runs(std::move(o.runs)) {
+            o.bytes = 0;
+            o.runs.clear();
+        }
+
+        Counter (Counter const &) = delete;
+        Counter &operator = (Counter const &) = delete;
+
+        ~Counter () {
+            release();
+            for (auto const &r: runs) {
+                unlink(r.path.c_str());
+            }
+        }
+
+        void add (char const *p, size_t n, size_t count = 1) {
+            auto r = table.insert(p, n);
+            r.first->value += count;
+            if (r.second) {
+                account();
+            }
+        }
+
+        // folds o into this counter and empties o
+        void merge (Counter &o) {
+            if (table.size() < o.table.size()) {
+                table.swap(o.table);
+                std::swap(bytes, o.bytes);
+            }
+            // account once o is released: account() may spill
+            o.table.for_each([&](Table::Slot const &s) {
+                table.insert(s.data, s.size, s.hash).first->value += s.value;
+            });
+            o.release();
+            runs.insert(runs.end(), o.runs.begin(), o.runs.end());
+            o.runs.clear();
+            account();
+        }
+
+        // true if every value is still in memory
+        bool in_memory () const {
+            return runs.empty();
+        }
+
+        // Calls f(data, size, count) once per distinct value, in no
+        // particular order, and empties the counter.
+        void visit (std::function<void(char const *, size_t, size_t)> const &f) {
+            auto each = [&f](Table::Slot const &s) {
+                f(s.data, s.size, s.value);
+            };
+            if (runs.empty()) {
+                table.for_each(each);
+                release();
+                return;
+            }
+            spill();
+            for (unsigned part = 0; part < PARTITIONS; ++part) {
+                Table all;
+                for (auto const &r: runs) {
+                    load(r, part, &all);
+                }
+                all.for_each(each);
+            }
+            for (auto const &r: runs) {
+                unlink(r.path.c_str());
+            }
+            runs.clear();
+        }
+    };
+}
+
+#endif
@@ -0,0 +1,524 @@
+#ifndef AAALGO_STREAM
+#define AAALGO_STREAM
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <map>
+#include <memory>
+#include <vector>
+#include <string>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <fstream>
+#include <iostream>
+#include <streambuf>
+#include <algorithm>
+#include <boost/assert.hpp>
+#include <zlib.h>
+#ifdef USE_ZSTD
+#include <zstd.h>
+#endif
+#include <omp.h>
+
+// Sequential inputs.
+//
+// Pipes and stdin have no size and can't be pread at an offset, so they
+// are read front to back through a Source.  Bytes can be peeked before
+// they are read: Format::train samples the beginning of a stream, and
+// BigText later reads the same bytes again from the start.
+//
+// Compressed inputs (gzip, and zstd with USE_ZSTD) are Sources too.
+// Files made of many independent members or frames (BGZF, pzstd and
+// seekable zstd) are decompressed ahead of the reader by a pool sized
+// like the OpenMP team, so OMP_NUM_THREADS bounds both; a single
+// gzip/zstd stream can only be inflated sequentially, which happens on
+// BigText's reader thread, overlapping with parsing.
+namespace stream {
+
+    class Source {
+        std::string head;       // peeked but not read yet, from pos
+        size_t pos;
+        bool eof;
+    protected:
+        // read up to n bytes, 0 at the end of input
+        virtual size_t fill (char *buf, size_t n) = 0;
+    public:
+        Source (): pos(0), eof(false) {
+        }
+
+        virtual ~Source () {
+        }
+
+        // Makes at least n bytes available, unless the input ends first,
+        // and returns everything peeked so far without consuming it.
+        std::string const &peek (size_t n) {
+            if (pos) {
+                head.erase(0, pos);
+                pos = 0;
+            }
+            while (!eof && head.size() < n) {
+                size_t have = head.size();
+                head.resize(n);
+                size_t r = fill(&head[have], n - have);
+                head.resize(have + r);
+                if (r == 0) eof = true;
+            }
+            return head;
+        }
+
+        // reads n bytes, less only at the end of input
+        size_t read (char *buf, size_t n) {
+            size_t done = 0;
+            if (pos < head.size()) {
+                done = std::min(n, head.size() - pos);
+                memcpy(buf, &head[pos], done);
+                pos += done;
+                if (pos == head.size()) {
+                    std::string().swap(head);
+                    pos = 0;
+                }
+            }
+            while (done < n && !eof) {
+                size_t r = fill(buf + done, n - done);
+                if (r == 0) eof = true;
+                done += r;
+            }
+            return done;
+        }
+
+        void skip (size_t n) {
+            std::vector<char> scratch(std::min<size_t>(n, 1 << 20));
+            while (n) {
+                size_t r = read(&scratch[0], std::min(n, scratch.size()));
+                if (r == 0) break;
+                n -= r;
+            }
+        }
+    };
+
+    class FdSource: public Source {
+        int fd;
+        bool owned;
+    protected:
+        size_t fill (char *buf, size_t n) {
+            for (;;) {
+                ssize_t r = ::read(fd, buf, n);
+                if (r >= 0) return r;
+                if (errno == EINTR) continue;
+                std::cerr << "read(" << fd << ", ..., " << n << "): " << strerror(errno) << std::endl;
+                BOOST_VERIFY(0);
+            }
+        }
+    public:
+        FdSource (int fd_, bool owned_): fd(fd_), owned(owned_) {
+        }
+
+        ~FdSource () {
+            if (owned) close(fd);
+        }
+    };
+
+    // Concatenated gzip members, inflated as they are read.
+    class GzipSource: public Source {
+        std::unique_ptr<Source> raw;
+        std::vector<char> in;
+        z_stream z;
+        bool member;            // inside a member
+        bool done;
+    protected:
+        size_t fill (char *buf, size_t n) {
+            z.next_out = reinterpret_cast<Bytef *>(buf);
+            z.avail_out = n;
+            while (z.avail_out == n && !done) {
+                if (z.avail_in == 0) {
+                    size_t r = raw->read(&in[0], in.size());
+                    if (r == 0) {
+                        if (member) std::cerr << "gzip input truncated." << std::endl;
+                        done = true;
+                        break;
+                    }
+                    z.next_in = reinterpret_cast<Bytef *>(&in[0]);
+                    z.avail_in = r;
+                }
+                member = true;
+                int r = inflate(&z, Z_NO_FLUSH);
+                if (r == Z_STREAM_END) {
+                    inflateReset(&z);
+                    member = false;
+                }
+                else if (r != Z_OK && r != Z_BUF_ERROR) {
+                    std::cerr << "inflate: " << (z.msg ? z.msg : "error") << std::endl;
+                    BOOST_VERIFY(0);
+                }
+            }
+            return n - z.avail_out;
+        }
+    public:
+        GzipSource (Source *raw_): raw(raw_), in(1 << 20), member(false), done(false) {
+            memset(&z, 0, sizeof(z));
+            int r = inflateInit2(&z, 15 + 16);
+            BOOST_VERIFY(r == Z_OK);
+        }
+
+        ~GzipSource () {
+            inflateEnd(&z);
+        }
+    };
+
+    // inflates the concatenated gzip members in [p, p + n) into out
+    inline void gunzip (char const *p, size_t n, std::string *out) {
+        z_stream z;
+        memset(&z, 0, sizeof(z));
+        int r = inflateInit2(&z, 15 + 16);
+        BOOST_VERIFY(r == Z_OK);
+        z.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(p));
+        z.avail_in = n;
+        out->clear();
+        while (z.avail_in) {
+            size_t have = out->size();
+            out->resize(have + std::max<size_t>(n, 1 << 16));
+            z.next_out = reinterpret_cast<Bytef *>(&(*out)[have]);
+            z.avail_out = out->size() - have;
+            r = inflate(&z, Z_NO_FLUSH);
+            out->resize(out->size() - z.avail_out);
+            if (r == Z_STREAM_END) {
+                inflateReset(&z);
+            }
+            else if (r != Z_OK) {
+                std::cerr << "inflate: " << (z.msg ? z.msg : "error") << std::endl;
+                BOOST_VERIFY(0);
+            }
+        }
+        inflateEnd(&z);
+    }
+
+    // Size of the BGZF member at p (BSIZE + 1 from the BC extra
+    // subfield), or 0 if it is a plain gzip member.
+    inline size_t bgzf_member (unsigned char const *p, size_t n) {
+        if (n < 18 || p[0] != 0x1f || p[1] != 0x8b || p[2] != 8 || !(p[3] & 4)) return 0;
+        size_t xlen = p[10] | (p[11] << 8);
+        unsigned char const *x = p + 12;
+        unsigned char const *xe = x + xlen;
+        if (xe > p + n) return 0;
+        while (x + 4 <= xe) {
+            size_t slen = x[2] | (x[3] << 8);
+            if (x[0] == 'B' && x[1] == 'C' && slen == 2 && x + 6 <= xe) {
+                return (x[4] | (x[5] << 8)) + 1;
+            }
+            x += 4 + slen;
+        }
+        return 0;
+    }
+
+#ifdef USE_ZSTD
+    // zstd frames, decompressed as they are read
+    class ZstdSource: public Source {
+        std::unique_ptr<Source> raw;
+        std::vector<char> in;
+        ZSTD_inBuffer zin;
+        ZSTD_DStream *ds;
+        bool frame;             // inside a frame
+        bool done;
+    protected:
+        size_t fill (char *buf, size_t n) {
+            ZSTD_outBuffer out = {buf, n, 0};
+            while (out.pos == 0 && !done) {
+                if (zin.pos == zin.size) {
+                    size_t r = raw->read(&in[0], in.size());
+                    if (r == 0) {
+                        if (frame) std::cerr << "zstd input truncated." << std::endl;
+                        done = true;
+                        break;
+                    }
+                    zin = {&in[0], r, 0};
+                }
+                size_t r = ZSTD_decompressStream(ds, &out, &zin);
+                if (ZSTD_isError(r)) {
+                    std::cerr << "zstd: " << ZSTD_getErrorName(r) << std::endl;
+                    BOOST_VERIFY(0);
+                }
+                frame = (r != 0);
+            }
+            return out.pos;
+        }
+    public:
+        ZstdSource (Source *raw_): raw(raw_), in(ZSTD_DStreamInSize()), zin{nullptr, 0, 0}, frame(false), done(false) {
+            ds = ZSTD_createDStream();
+            ZSTD_initDStream(ds);
+        }
+
+        ~ZstdSource () {
+            ZSTD_freeDStream(ds);
+        }
+    };
+
+    inline void unzstd (char const *p, size_t n, std::string *out) {
+        ZSTD_DStream *ds = ZSTD_createDStream();
+        ZSTD_initDStream(ds);
+        ZSTD_inBuffer in = {p, n, 0};
+        out->clear();
+        while (in.pos < in.size) {
+            size_t have = out->size();
+            out->resize(have + std::max<size_t>(n, ZSTD_DStreamOutSize()));
+            ZSTD_outBuffer o = {&(*out)[have], out->size() - have, 0};
+            size_t r = ZSTD_decompressStream(ds, &o, &in);
+            out->resize(have + o.pos);
+            if (ZSTD_isError(r)) {
+                std::cerr << "zstd: " << ZSTD_getErrorName(r) << std::endl;
+                BOOST_VERIFY(0);
+            }
+        }
+        ZSTD_freeDStream(ds);
+    }
+#endif
+
+    // Independent compressed frames of a mapped file.  Frames are
+    // grouped into tasks of at least GROUP compressed bytes; a pool of
+    // threads decompresses up to `window` tasks ahead of the reader and
+    // they are handed out in order.
+    class FrameSource: public Source {
+    public:
+        typedef void (*Decode) (char const *, size_t, std::string *);
+    private:
+        char const *map;
+        size_t map_size;
+        Decode decode;
+        std::vector<std::pair<size_t, size_t>> tasks;
+        size_t window;
+        std::vector<std::string> slots;
+        std::vector<char> ready;
+        size_t next_task;       // next task to decompress
+        size_t next_out;        // next task to hand out
+        bool stop;
+        std::mutex mutex;
+        std::condition_variable cond;
+        std::vector<std::thread> workers;
+        std::string cur;
+        size_t cur_pos;
+
+        void work () {
+            std::unique_lock<std::mutex> lock(mutex);
+            for (;;) {
+                cond.wait(lock, [this]() {
+                    return stop || next_task >= tasks.size() || next_task < next_out + window;
+                });
+                if (stop || next_task >= tasks.size()) return;
+                size_t i = next_task++;
+                lock.unlock();
+                std::string out;
+                decode(map + tasks[i].first, tasks[i].second - tasks[i].first, &out);
+                lock.lock();
+                slots[i % window].swap(out);
+                ready[i % window] = 1;
+                cond.notify_all();
+            }
+        }
+    protected:
+        size_t fill (char *buf, size_t n) {
+            while (cur_pos == cur.size()) {
+                if (next_out == tasks.size()) return 0;
+                std::unique_lock<std::mutex> lock(mutex);
+                size_t s = next_out % window;
+                cond.wait(lock, [this, s]() { return ready[s] != 0; });
+                cur.swap(slots[s]);
+                std::string().swap(slots[s]);
+                ready[s] = 0;
+                ++next_out;
+                cur_pos = 0;
+                cond.notify_all();
+            }
+            size_t k = std::min(n, cur.size() - cur_pos);
+            memcpy(buf, &cur[cur_pos], k);
+            cur_pos += k;
+            return k;
+        }
+    public:
+        static size_t const GROUP = 1 << 20;
+
+        // frames are the [begin, end) offsets of each frame in the mapping
+        FrameSource (char const *map_, size_t size, Decode d, std::vector<std::pair<size_t, size_t>> const &frames, unsigned threads)
+            : map(map_), map_size(size), decode(d), next_task(0), next_out(0), stop(false), cur_pos(0) {
+            for (auto const &f: frames) {
+                if (tasks.empty() || tasks.back().second - tasks.back().first >= GROUP) {
+                    tasks.push_back(f);
+                }
+                else {
+                    tasks.back().second = f.second;
+                }
+            }
+            if (threads == 0) threads = 1;
+            window = 2 * threads;
+            slots.resize(window);
+            ready.resize(window, 0);
+            for (unsigned i = 0; i < threads; ++i) {
+                workers.emplace_back(&FrameSource::work, this);
+            }
+        }
+
+        ~FrameSource () {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                stop = true;
+                cond.notify_all();
+            }
+            for (auto &t: workers) t.join();
+            munmap(const_cast<char *>(map), map_size);
+        }
+    };
+
+    // A FrameSource over fd if it holds more than one independent gzip
+    // member / zstd frame, otherwise nullptr.
+    inline Source *open_frames (int fd, size_t size, bool gzip) {
+        if (size == 0) return nullptr;
+        void *m = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (m == MAP_FAILED) return nullptr;
+        madvise(m, size, MADV_SEQUENTIAL);
+        unsigned char const *p = reinterpret_cast<unsigned char const *>(m);
+        std::vector<std::pair<size_t, size_t>> frames;
+        FrameSource::Decode decode = nullptr;
+        if (gzip) {
+            size_t off = 0;
+            while (off < size) {
+                size_t n = bgzf_member(p + off, size - off);
+                if (n == 0 || off + n > size) {
+                    frames.clear();
+                    break;
+                }
+                frames.push_back(std::make_pair(off, off + n));
+                off += n;
+            }
+            decode = gunzip;
+        }
+#ifdef USE_ZSTD
+        else {
+            size_t off = 0;
+            while (off < size) {
+                size_t n = ZSTD_findFrameCompressedSize(p + off, size - off);
+                if (ZSTD_isError(n)) {
+                    frames.clear();
+                    break;
+                }
+                frames.push_back(std::make_pair(off, off + n));
+                off += n;
+            }
+            decode = unzstd;
+        }
+#endif
+        if (frames.size() < 2) {
+            munmap(m, size);
+            return nullptr;
+        }
+        // not under USE_OPENMP, which csvlint.cpp doesn't define: an
+        // inline function must be the same everywhere
+        unsigned threads = omp_get_max_threads();
+        return new FrameSource(reinterpret_cast<char const *>(m), size, decode, frames, threads);
+    }
+
+    inline bool is_gzip (std::string const &m) {
+        return m.size() >= 2 && m[0] == '\x1f' && m[1] == '\x8b';
+    }
+
+    inline bool is_zstd (std::string const &m) {
+        return m.size() >= 4 && m.compare(0, 4, "\x28\xb5\x2f\xfd") == 0;
+    }
+
+    // wraps raw in a decompressor if its content is compressed
+    inline Source *decompress (Source *raw) {
+        std::string const &magic = raw->peek(4);
+        if (is_gzip(magic)) return new GzipSource(raw);
+        if (is_zstd(magic)) {
+#ifdef USE_ZSTD
+            return new ZstdSource(raw);
+#else
+            std::cerr << "zstd input needs a build with USE_ZSTD." << std::endl;
+            BOOST_VERIFY(0);
+#endif
+        }
+        return raw;
+    }
+
+    // The Source of path if it has to be read sequentially ("-" for
+    // stdin, pipes, devices, compressed files), or nullptr if it is a
+    // plain regular file.  Sources are opened once per process and
+    // shared, so whatever was peeked is still there for the next reader.
+    inline Source *get (std::string const &path) {
+        static std::map<std::string, std::unique_ptr<Source>> sources;
+        auto it = sources.find(path);
+        if (it != sources.end()) return it->second.get();
+        Source *src = nullptr;
+        if (path == "-") {
+            src = decompress(new FdSource(STDIN_FILENO, false));
+        }
+        else {
+            int fd = open(path.c_str(), O_RDONLY);
+            if (fd < 0) {
+                std::cerr << "open(" << path << "): " << strerror(errno) << std::endl;
+                BOOST_VERIFY(0);
+            }
+            struct stat st;
+            int r = fstat(fd, &st);
+            BOOST_VERIFY(r == 0);
+            std::string magic(4, 0);
+            if (!S_ISREG(st.st_mode)) {
+                src = decompress(new FdSource(fd, true));
+            }
+            else if (pread(fd, &magic[0], 4, 0) == 4 && (is_gzip(magic) || is_zstd(magic))) {
+                src = open_frames(fd, st.st_size, is_gzip(magic));
+                if (src) {
+                    close(fd);
+                }
+                else {
+                    src = decompress(new FdSource(fd, true));
+                }
+            }
+            else {
+                close(fd);
+            }
+        }
+        sources[path].reset(src);
+        return src;
+    }
+
+    class SourceBuf: public std::streambuf {
+        Source *src;
+        std::vector<char> buf;
+    protected:
+        int_type underflow () {
+            size_t r = src->read(&buf[0], buf.size());
+            if (r == 0) return traits_type::eof();
+            setg(&buf[0], &buf[0], &buf[0] + r);
+            return traits_type::to_int_type(buf[0]);
+        }
+    public:
+        SourceBuf (Source *src_): src(src_), buf(1 << 20) {
+        }
+    };
+
+    // istream over path from byte offset, for line-at-a-time readers
+    class Input: public std::istream {
+        std::filebuf file;
+        std::unique_ptr<SourceBuf> sbuf;
+    public:
+        Input (std::string const &path, size_t offset = 0): std::istream(nullptr) {
+            if (Source *src = stream::get(path)) {
+                src->skip(offset);
+                sbuf.reset(new SourceBuf(src));
+                rdbuf(sbuf.get());
+            }
+            else if (file.open(path.c_str(), std::ios::in)) {
+                rdbuf(&file);
+                seekg(offset);
+            }
+            else {
+                setstate(std::ios::failbit);
+            }
+        }
+    };
+}
+
+#endif
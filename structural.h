@@ -0,0 +1,178 @@
+#ifndef AAALGO_STRUCTURAL
+#define AAALGO_STRUCTURAL
+
+#include <stdint.h>
+#include <string.h>
+#if defined(__AVX2__) || defined(__PCLMUL__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+// Structural character indexing.
+//
+// Text is processed 64 bytes at a time.  For each block we compute a
+// bitmap per structural character (bit i set iff byte i matches) with
+// SIMD compare + movemask, and quoted regions are masked out with a
+// prefix-XOR of the quote bitmap, so field and record boundaries can be
+// enumerated with ctz instead of testing every byte.
+namespace structural {
+
+    static unsigned const BLOCK = 64;
+
+    static inline uint64_t mask_below (unsigned n) {
+        return n >= 64 ? ~uint64_t(0) : ((uint64_t(1) << n) - 1);
+    }
+
+    static inline unsigned ctz (uint64_t v) {
+        return __builtin_ctzll(v);
+    }
+
+    // bit i of the result is the XOR of bits 0..i of the input,
+    // i.e. set for every byte between an opening and a closing quote
+    static inline uint64_t prefix_xor (uint64_t v) {
+#if defined(__PCLMUL__)
+        __m128i r = _mm_clmulepi64_si128(_mm_set_epi64x(0, v), _mm_set1_epi8(-1), 0);
+        return uint64_t(_mm_cvtsi128_si64(r));
+#else
+        v ^= v << 1;
+        v ^= v << 2;
+        v ^= v << 4;
+        v ^= v << 8;
+        v ^= v << 16;
+        v ^= v << 32;
+        return v;
+#endif
+    }
+
+    // n <= 64 bytes starting at p are valid.  Loads are always full 64
+    // bytes; reading past the end is fine as long as we stay within the
+    // page, otherwise the tail is copied out first.
+    static inline char const *load_ptr (char const *p, unsigned n, char *pad) {
+        if (n < BLOCK && ((uintptr_t(p) & 4095) > 4096 - BLOCK)) {
+            memcpy(pad, p, n);
+            memset(pad + n, 0, BLOCK - n);
+            return pad;
+        }
+        return p;
+    }
+
+#if defined(__AVX2__)
+    static inline uint64_t cmp64 (__m256i lo, __m256i hi, char c) {
+        __m256i v = _mm256_set1_epi8(c);
+        uint64_t l = uint32_t(_mm256_movemask_epi8(_mm256_cmpeq_epi8(lo, v)));
+        uint64_t h = uint32_t(_mm256_movemask_epi8(_mm256_cmpeq_epi8(hi, v)));
+        return l | (h << 32);
+    }
+#elif defined(__SSE2__)
+    static inline uint64_t cmp64 (__m128i const *x, char c) {
+        __m128i v = _mm_set1_epi8(c);
+        uint64_t r = 0;
+        for (unsigned k = 0; k < 4; ++k) {
+            r |= uint64_t(uint16_t(_mm_movemask_epi8(_mm_cmpeq_epi8(x[k], v)))) << (16 * k);
+        }
+        return r;
+    }
+#endif
+
+    // bitmaps of c1 and c2 in the n valid bytes at p
+    static inline void match64 (char const *p, unsigned n, char c1, char c2, uint64_t *m1, uint64_t *m2) {
+        char pad[BLOCK];
+        char const *s = load_ptr(p, n, pad);
+#if defined(__AVX2__)
+        __m256i lo = _mm256_loadu_si256(reinterpret_cast<__m256i const *>(s));
+        __m256i hi = _mm256_loadu_si256(reinterpret_cast<__m256i const *>(s + 32));
+        *m1 = cmp64(lo, hi, c1);
+        if (m2) *m2 = cmp64(lo, hi, c2);
+#elif defined(__SSE2__)
+        __m128i x[4];
+        for (unsigned k = 0; k < 4; ++k) {
+            x[k] = _mm_loadu_si128(reinterpret_cast<__m128i const *>(s + 16 * k));
+        }
+        *m1 = cmp64(x, c1);
+        if (m2) *m2 = cmp64(x, c2);
+#else
+        uint64_t r1 = 0, r2 = 0;
+        for (unsigned k = 0; k < BLOCK; ++k) {
+            r1 |= uint64_t(s[k] == c1) << k;
+            r2 |= uint64_t(s[k] == c2) << k;
+        }
+        *m1 = r1;
+        if (m2) *m2 = r2;
+#endif
+        uint64_t valid = mask_below(n);
+        *m1 &= valid;
+        if (m2) *m2 &= valid;
+    }
+
+    static inline uint64_t match64 (char const *p, unsigned n, char c) {
+        uint64_t m;
+        match64(p, n, c, c, &m, nullptr);
+        return m;
+    }
+
+    // first occurrence of c in [b, e), or e
+    static inline char const *find (char const *b, char const *e, char c) {
+        for (char const *p = b; p < e; p += BLOCK) {
+            unsigned n = (e - p) < BLOCK ? unsigned(e - p) : BLOCK;
+            uint64_t m = match64(p, n, c);
+            if (m) return p + ctz(m);
+        }
+        return e;
+    }
+
+    // calls f(p) for every p in [b, e) with *p == c, in order
+    template <typename F>
+    void for_each (char const *b, char const *e, char c, F const &f) {
+        for (char const *p = b; p < e; p += BLOCK) {
+            unsigned n = (e - p) < BLOCK ? unsigned(e - p) : BLOCK;
+            uint64_t m = match64(p, n, c);
+            while (m) {
+                f(p + ctz(m));
+                m &= m - 1;
+            }
+        }
+    }
+
+    // Splits [b, e) into fields separated by fs; separators between a
+    // pair of quotes do not count.  quote == 0 disables quoting.
+    // Calls f(begin, end, broken) for every field, where broken is set
+    // if the field contains a masked-out separator.  An empty input
+    // produces no field.
+    template <typename F>
+    void split (char const *b, char const *e, char fs, char quote, F const &f) {
+        if (b >= e) return;
+        char const *field = b;
+        bool broken = false;
+        uint64_t carry = 0;     // all ones if the previous block ended inside quotes
+        for (char const *p = b; p < e; p += BLOCK) {
+            unsigned n = (e - p) < BLOCK ? unsigned(e - p) : BLOCK;
+            uint64_t fm, qm, inside = 0;
+            if (quote) {
+                match64(p, n, fs, quote, &fm, &qm);
+                inside = prefix_xor(qm) ^ carry;
+                carry = uint64_t(int64_t(inside) >> 63);
+            }
+            else {
+                fm = match64(p, n, fs);
+            }
+            uint64_t seps = fm & ~inside;
+            uint64_t masked = fm & inside;
+            while (seps) {
+                unsigned i = ctz(seps);
+                if (masked & mask_below(i)) {
+                    broken = true;
+                    masked &= ~mask_below(i);
+                }
+                f(field, p + i, broken);
+                field = p + i + 1;
+                broken = false;
+                seps &= seps - 1;
+            }
+            if (masked) broken = true;
+        }
+        f(field, e, broken);
+    }
+}
+
+#endif